@@ -22,11 +22,13 @@
 #include "emi.h"
 #include "config.h"
 #include "cm_tp1.h"
+#include "router.h"
 
 EIBNetIPRouter::EIBNetIPRouter (const LinkConnectPtr_& c, IniSectionPtr& s)
-  : HWBusDriver(c,s)
+  : HWBusDriver(c,s), flow(t)
 {
   t->setAuxName("ip");
+  flow.on_next.set<EIBNetIPRouter,&EIBNetIPRouter::flow_next_cb>(this);
 }
 
 void
@@ -85,6 +87,7 @@ EIBNetIPRouter::stop(bool err)
 void
 EIBNetIPRouter::stop_()
 {
+  flow.stop();
   if (sock)
     {
       delete sock;
@@ -101,10 +104,9 @@ EIBNetIPRouter::~EIBNetIPRouter ()
 bool
 EIBNetIPRouter::setup()
 {
-  if (!assureFilter("pace"))
-    return false;
   if(!HWBusDriver::setup())
     return false;
+  flow.setup(cfg);
   multicastaddr = cfg->value("multicast-address","224.0.23.12");
   port = cfg->value("port",3671);
   interface = cfg->value("interface","");
@@ -118,13 +120,39 @@ EIBNetIPRouter::send_L_Data (LDataPtr l)
   EIBNetIPPacket p;
   p.data = L_Data_ToCEMI (0x29, l);
   p.service = ROUTING_INDICATION;
-  sock->Send (p);
+  if (flow.Send (sock, p, sock->sendaddr))
+    send_Next();
+}
+
+void
+EIBNetIPRouter::flow_next_cb()
+{
   send_Next();
 }
 
 void
 EIBNetIPRouter::read_cb(EIBNetIPPacket *p)
 {
+  if (p->service == ROUTING_BUSY)
+    {
+      EIBnet_RoutingBusy r;
+      if (parseEIBnet_RoutingBusy (*p, r))
+        t->TracePacket (2, "unparseable ROUTING_BUSY", p->data);
+      else
+        flow.busy (r);
+      delete p;
+      return;
+    }
+  if (p->service == ROUTING_LOST_MESSAGE)
+    {
+      EIBnet_RoutingLostMessage r;
+      if (parseEIBnet_RoutingLostMessage (*p, r))
+        t->TracePacket (2, "unparseable ROUTING_LOST_MESSAGE", p->data);
+      else
+        flow.lost (r);
+      delete p;
+      return;
+    }
   if (p->service != ROUTING_INDICATION)
     {
       delete p;
@@ -149,7 +177,13 @@ EIBNetIPRouter::read_cb(EIBNetIPPacket *p)
   if (c)
     {
       if (!monitor)
-        recv_L_Data (std::move(c));
+        {
+          recv_L_Data (std::move(c));
+          auto cn = conn.lock();
+          if (cn && sock)
+            flow.check_busy (sock, sock->sendaddr,
+                             static_cast<Router &>(cn->router).queue_length());
+        }
       else
         {
           LBusmonPtr p1 = LBusmonPtr(new L_Busmon_PDU ());
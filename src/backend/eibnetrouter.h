@@ -28,6 +28,8 @@ DRIVER(EIBNetIPRouter,ip)
 {
   /** EIBnet/IP socket */
   EIBNetIPSocket *sock;
+  /** rate limiting and ROUTING_BUSY handling */
+  EIBnetRoutingFlow flow;
 
   std::string interface;
   std::string multicastaddr;
@@ -35,6 +37,7 @@ DRIVER(EIBNetIPRouter,ip)
   bool monitor;
 
   void read_cb(EIBNetIPPacket *p);
+  void flow_next_cb();
   void stop_();
 public:
   EIBNetIPRouter (const LinkConnectPtr_& c, IniSectionPtr& s);
@@ -48,6 +48,8 @@ void EIBNetIPTunnel::is_stopped()
 
 void EIBNetIPTunnel::stop(bool err)
 {
+  TRACEPRINTF (t, 2, "sent %d, resent %d, RTT %.1f ms",
+               n_sent, n_resent, rto.srtt () * 1000);
   restart();
   is_stopped();
   HWBusDriver::stop(err);
@@ -79,6 +81,10 @@ EIBNetIPTunnel::setup()
     }
   heartbeat_time = cfg->value("heartbeat-timer",30);
   heartbeat_limit = cfg->value("heartbeat-retries",3);
+  window = cfg->value("window",1);
+  if (window < 1 || window > 32)
+    window = 1;
+  rto.setup(cfg);
   return true;
 }
 
@@ -133,6 +139,10 @@ EIBNetIPTunnel::start()
 
   TRACEPRINTF (t, 2, "Opened");
   out.clear();
+  inflight = 0;
+  sent_at.clear();
+  resent = 0;
+  do_send_next = false;
   return;
 ex:
   if (sock)
@@ -333,10 +343,21 @@ EIBNetIPTunnel::read_cb (EIBNetIPPacket *p1)
           TRACEPRINTF (t, 1, "Not for us (tresp.chan %d != %d)", tresp.channel,channel);
           break;
         }
-      if (tresp.seqno != sno)
+      // With a window, an ACK covers all earlier frames: the server
+      // doesn't accept frames out of order.
+      unsigned n = (uint8_t)(tresp.seqno - sno) + 1;
+      if (mod == 2 && n > inflight)
         {
-          TRACEPRINTF (t, 1, "Wrong sequence %d<->%d",
-                       tresp.seqno, sno);
+          if (window > 1 && tresp.seqno == ((sno - 1) & 0xff) && !fast_resent)
+            {
+              // the server got a duplicate and is still waiting for sno
+              TRACEPRINTF (t, 1, "Duplicate ACK for %d, resending %d", tresp.seqno, inflight);
+              fast_resent = true;
+              retransmit();
+            }
+          else
+            TRACEPRINTF (t, 1, "Wrong sequence %d<->%d",
+                         tresp.seqno, sno);
           break;
         }
       if (tresp.status)
@@ -346,14 +367,31 @@ EIBNetIPTunnel::read_cb (EIBNetIPPacket *p1)
         }
       if (mod == 2)
         {
-          sno++;
-          if (sno > 0xff)
-            sno = 0;
-          out.clear();
-          send_Next();
-          mod = 1;
-          trigger.send();
+          if (sent_at[n - 1])
+            rto.sample (ev_now (EV_DEFAULT) - sent_at[n - 1]);
+          while (n--)
+            {
+              out.pop_front();
+              sent_at.pop_front();
+              inflight--;
+              n_sent++;
+              if (resent)
+                resent--;
+              sno = (sno + 1) & 0xff;
+            }
           retry = 0;
+          fast_resent = false;
+          timeout.stop();
+          if (inflight)
+            timeout.start(rto.timeout(),0);
+          else
+            mod = 1;
+          if (do_send_next && out.size() < window)
+            {
+              do_send_next = false;
+              send_Next();
+            }
+          trigger.send();
         }
       else
         TRACEPRINTF (t, 1, "Unexpected ACK mod=%d",mod);
@@ -460,26 +498,49 @@ err:
 void
 EIBNetIPTunnel::send_L_Data (LDataPtr l)
 {
-  assert(out.size() == 0);
-  out = L_Data_ToCEMI (0x11, l);
+  assert(!do_send_next);
+  out.push_back(L_Data_ToCEMI (0x11, l));
   trigger.send();
+  if (out.size() < window)
+    send_Next();
+  else
+    do_send_next = true;
 }
 
 void EIBNetIPTunnel::trigger_cb(ev::async &, int)
 {
-  if (mod != 1 || out.size() == 0)
+  if (mod != 1 && mod != 2)
     return;
 
-  EIBnet_TunnelRequest treq;
-  treq.channel = channel;
-  treq.seqno = sno;
-  treq.CEMI = out;
+  ev_tstamp now = ev_now (EV_DEFAULT);
+  while (inflight < window && inflight < out.size())
+    {
+      EIBnet_TunnelRequest treq;
+      treq.channel = channel;
+      treq.seqno = (sno + inflight) & 0xff;
+      treq.CEMI = out[inflight];
+
+      EIBNetIPPacket p = treq.ToPacket ();
+      t->TracePacket (1, "SendTunnel", p.data);
+      sock->Send (p, daddr);
+      // Karn: don't measure the RTT of retransmitted frames
+      sent_at.push_back (inflight < resent ? 0 : now);
+      inflight++;
+      mod = 2;
+    }
+  if (inflight && !timeout.is_active())
+    timeout.start(rto.timeout(),0);
+}
 
-  EIBNetIPPacket p = treq.ToPacket ();
-  t->TracePacket (1, "SendTunnel", p.data);
-  sock->Send (p, daddr);
-  mod = 2;
-  timeout.start(1,0);
+void EIBNetIPTunnel::retransmit()
+{
+  n_resent += inflight;
+  resent = inflight;
+  inflight = 0;
+  sent_at.clear();
+  timeout.stop();
+  mod = 1;
+  trigger.send();
 }
 
 void EIBNetIPTunnel::conntimeout_cb(ev::timer &, int)
@@ -550,12 +611,15 @@ EIBNetIPTunnel::timeout_cb(ev::timer &, int)
   if (retry++ > 3)
     {
       out.clear();
+      do_send_next = false;
       TRACEPRINTF (t, 1, "Too many retransmits, disconnecting");
       restart();
     }
   else
-    TRACEPRINTF (t, 1, "Retry");
-  mod = 1;
-  trigger.send();
+    {
+      TRACEPRINTF (t, 1, "Retry");
+      rto.backoff();
+    }
+  retransmit();
 }
 
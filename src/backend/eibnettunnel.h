@@ -31,7 +31,21 @@ DRIVER(EIBNetIPTunnel,ipt)
   struct sockaddr_in saddr;
   struct sockaddr_in raddr;
 
-  CArray out;
+  /** frames to send; the first 'inflight' of them await their ACK */
+  std::deque < CArray > out;
+  unsigned window = 1;
+  unsigned inflight = 0;
+  /** when these were sent; zero if they are retransmissions */
+  std::deque < ev_tstamp > sent_at;
+  unsigned resent = 0;
+  bool fast_resent = false;
+  bool do_send_next = false;
+  EIBnetRTO rto;
+  /** statistics */
+  unsigned long n_sent = 0;
+  unsigned long n_resent = 0;
+  void retransmit();
+
   bool NAT;
   bool monitor;
   std::string dest;
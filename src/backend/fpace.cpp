@@ -19,15 +19,30 @@
 
 #include "fpace.h"
 
+#include <algorithm>
+#include <math.h>
+
+/** Time a TP1 telegram with this payload occupies the bus, in seconds:
+ * 50 bit times idle, the telegram itself (13 bits per octet incl. the gap),
+ * 15 bits until the acknowledgement, and that. 9600 baud. */
+static float
+tp1_time (size_t lsdu_len)
+{
+  size_t octets = lsdu_len + (lsdu_len > 15 ? 8 : 7);
+  return (50 + 13*octets + 15 + 13) / 9600.;
+}
+
 PaceFilter::PaceFilter (const LinkConnectPtr_& c, IniSectionPtr& s) : Filter(c,s)
 {
   timer.set<PaceFilter, &PaceFilter::timer_cb>(this);
+  stats_timer.set<PaceFilter, &PaceFilter::stats_timer_cb>(this);
   state = P_DOWN;
 }
 
 PaceFilter::~PaceFilter()
 {
   timer.stop();
+  stats_timer.stop();
 }
 
 bool
@@ -56,9 +71,93 @@ PaceFilter::setup()
       ERRORPRINTF(t, E_ERROR | 2, "The factor for incoming packets must be >=0");
       return false;
     }
+  adaptive = cfg->value("adaptive",false);
+  target_load = cfg->value("target-load",0.6);
+  max_delay = cfg->value("max-delay",500)/1000.;
+  load_window = cfg->value("load-window",2.0);
+  stats_interval = cfg->value("stats-interval",60.0);
+  if (target_load <= 0 || target_load > 1 || max_delay < 0 || load_window <= 0 || stats_interval < 0)
+    {
+      ERRORPRINTF(t, E_ERROR | 157, "target-load must be >0 and <=1, max-delay >=0, load-window >0, stats-interval >=0");
+      return false;
+    }
   return true;
 }
 
+void
+PaceFilter::decay_load()
+{
+  timestamp_t now = getTime();
+  if (busy_last)
+    {
+      float f = expf(-(now - busy_last) / 1000000. / load_window);
+      busy_other *= f;
+      busy_own *= f;
+    }
+  busy_last = now;
+}
+
+float
+PaceFilter::load()
+{
+  decay_load();
+  return (busy_other + busy_own) / load_window;
+}
+
+float
+PaceFilter::adaptive_gap()
+{
+  // If the others use up "other" of the bus, we may use "target - other".
+  // Sending a telegram taking "f" seconds then needs f/room in total.
+  float u = load();
+  float other = busy_other / load_window;
+  float f = tp1_time(last_len);
+  float room = target_load - other;
+  float g = (room > 0) ? f/room - f : max_delay;
+
+  if (max_load < u)
+    max_load = u;
+  // BUSY/NACK: the bus is worse than it looks, so back off
+  if (n_congested)
+    g = std::max(g, delay * (1 << std::min(n_congested, 5)));
+  return std::min(std::max(g, 0.f), max_delay);
+}
+
+void
+PaceFilter::bus_ack(enum PACK ack)
+{
+  switch(ack)
+    {
+    case PA_ACK:
+      n_congested = 0;
+      break;
+    case PA_NACK:
+      n_nack++;
+      n_congested++;
+      break;
+    case PA_BUSY:
+      n_busy++;
+      n_congested++;
+      break;
+    case PA_NACK_OTHER:
+      n_nack_other++;
+      break;
+    }
+}
+
+void
+PaceFilter::trace_stats()
+{
+  TRACEPRINTF (t, 4, "load %.0f%% (max %.0f%%), delay %.1f ms, %lu BUSY, %lu NACK, %lu NACK by others",
+               load()*100, max_load*100, gap*1000, n_busy, n_nack, n_nack_other);
+}
+
+void
+PaceFilter::stats_timer_cb (ev::timer &, int)
+{
+  trace_stats();
+}
+
 void
 PaceFilter::start()
 {
@@ -81,6 +180,8 @@ PaceFilter::started()
       ERRORPRINTF(t, E_WARNING | 110, "state %d??", state);
       break;
     }
+  if (adaptive && stats_interval > 0)
+    stats_timer.start(stats_interval, stats_interval);
   Filter::started();
 }
 
@@ -90,6 +191,9 @@ PaceFilter::stopped(bool err)
   state = P_DOWN;
   want_next = false;
   timer.stop();
+  stats_timer.stop();
+  if (adaptive)
+    trace_stats();
   Filter::stopped(err);
 }
 
@@ -105,8 +209,18 @@ PaceFilter::send_Next()
     {
       float this_delay;
       state = P_BUSY;
-      this_delay = last_len*byte_delay + delay;
-      TRACEPRINTF (t, 2, "out 1/%d: delay for %.3f sec", last_len, this_delay);
+      if (adaptive)
+        {
+          this_delay = adaptive_gap();
+          gap_start = getTime();
+          gap = this_delay;
+          TRACEPRINTF (t, 2, "out 1/%d: load %.0f%%, delay for %.3f sec", last_len, load()*100, this_delay);
+        }
+      else
+        {
+          this_delay = last_len*byte_delay + delay;
+          TRACEPRINTF (t, 2, "out 1/%d: delay for %.3f sec", last_len, this_delay);
+        }
       timer.start(this_delay);
     }
     break;
@@ -124,7 +238,20 @@ PaceFilter::timer_cb (ev::timer &, int)
       TRACEPRINTF (t, 2, "state: not busy ??");
       return;
     }
-  if (factor_in > 0 && nr_in > 0)
+  if (adaptive)
+    {
+      // other devices may have been busy in the meantime
+      float g = adaptive_gap();
+      float done = (getTime() - gap_start) / 1000000.;
+      if (done + 0.001 < g)
+        {
+          TRACEPRINTF (t, 2, "load %.0f%%: delay more, for %.3f sec", load()*100, g - done);
+          gap = g;
+          timer.start(g - done);
+          return;
+        }
+    }
+  else if (factor_in > 0 && nr_in > 0)
     {
       float this_delay = (size_in*byte_delay + nr_in*delay) * factor_in;
       TRACEPRINTF (t, 2, "in %d/%d %f/%f/%f: delay more, for %.3f sec", nr_in,size_in, delay,byte_delay,factor_in, this_delay);
@@ -142,6 +269,11 @@ void
 PaceFilter::send_L_Data (LDataPtr l)
 {
   last_len = l->lsdu.size();
+  if (adaptive)
+    {
+      decay_load();
+      busy_own += tp1_time(last_len);
+    }
   Filter::send_L_Data(std::move(l));
 }
 
@@ -149,7 +281,12 @@ void
 PaceFilter::recv_L_Data (LDataPtr l)
 {
   nr_in += 1;
-  size_in = l->lsdu.size();
+  size_in += l->lsdu.size();
+  if (adaptive)
+    {
+      decay_load();
+      busy_other += tp1_time(l->lsdu.size());
+    }
   Filter::recv_L_Data(std::move(l));
 }
 
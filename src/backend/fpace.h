@@ -30,12 +30,29 @@ and signals send_Next some time after a packet is sent.
 
 If there is no queue in front of this filter, the rate limit acts globally.
 This is probably not intentional, and thus warned about.
+
+In adaptive mode, the filter estimates how busy the TP1 line is, from
+the length of the telegrams it sees in either direction. It then picks
+the gap after each outgoing telegram so that the line stays below a
+target load. Drivers which see the bus directly (TPUART) also report
+BUSY acknowledgements and failed sends, which make the filter back off
+further. NACKs by other devices are only counted: they usually mean a
+garbled telegram, not a congested line.
 */
 
 #ifndef FPACE_H
 #define FPACE_H
 #include "link.h"
 
+/** what a driver saw on the bus, see PaceFilter::bus_ack() */
+enum PACK
+{
+  PA_ACK,    // our telegram was confirmed
+  PA_NACK,   // our telegram was not confirmed
+  PA_BUSY,   // some device said BUSY
+  PA_NACK_OTHER, // some device said NACK to a telegram, not necessarily ours
+};
+
 enum PSTATE
 {
   P_DOWN,    // not running, not marked as requiring a Pace
@@ -56,6 +73,34 @@ FILTER(PaceFilter,pace)
   ev::timer timer;
   void timer_cb(ev::timer &w, int revents);
 
+  /** adaptive mode */
+  bool adaptive;
+  float target_load;
+  float max_delay;
+  float load_window;
+  /** estimated bus time used by others, and by us, within load_window */
+  float busy_other = 0;
+  float busy_own = 0;
+  timestamp_t busy_last = 0;
+  /** age busy_other and busy_own to the current time */
+  void decay_load();
+  /** consecutive BUSY/NACK reports */
+  int n_congested = 0;
+  /** when the current gap started, and how long it is */
+  timestamp_t gap_start = 0;
+  float gap = 0;
+  float adaptive_gap();
+  /** statistics */
+  unsigned long n_busy = 0;
+  unsigned long n_nack = 0;
+  unsigned long n_nack_other = 0;
+  float max_load = 0;
+  /** trace the statistics every stats_interval seconds */
+  float stats_interval;
+  ev::timer stats_timer;
+  void stats_timer_cb(ev::timer &w, int revents);
+  void trace_stats();
+
 public:
   PaceFilter (const LinkConnectPtr_& c, IniSectionPtr& s);
   virtual ~PaceFilter ();
@@ -69,6 +114,10 @@ public:
   virtual void started();
   virtual void stopped(bool err);
 
+  /** Called by drivers which can see the bus's acknowledgements. */
+  void bus_ack(enum PACK ack);
+  /** Estimated line utilisation, 0…1. */
+  float load();
 };
 
 #endif
@@ -19,6 +19,11 @@
 
 #include "fqueue.h"
 
+#include <cstdio>
+
+static const char *prio_names[N_PRIO] = { "system", "urgent", "normal", "low" };
+static const timestamp_t delay_limits[N_DELAYS] = { 10000, 100000, 1000000, 10000000 };
+
 QueueFilter::QueueFilter (const LinkConnectPtr_& c, IniSectionPtr& s) : Filter(c,s)
 {
   trigger.set<QueueFilter, &QueueFilter::trigger_cb>(this);
@@ -46,7 +51,32 @@ QueueFilter::setup()
     }
   if (!Filter::setup())
     return false;
-  // XXX options?
+
+  int md = cfg->value("max-depth", 0);
+  if (md < 0)
+    {
+      ERRORPRINTF(t, E_ERROR | 154, "max-depth must not be negative");
+      return false;
+    }
+  max_depth = md;
+
+  std::string policy = cfg->value("policy", "strict");
+  if (policy == "weighted")
+    weighted = true;
+  else if (policy != "strict")
+    {
+      ERRORPRINTF(t, E_ERROR | 155, "policy must be 'strict' or 'weighted'");
+      return false;
+    }
+  std::string w = cfg->value("weights", "8,4,2,1");
+  if (sscanf(w.c_str(), "%d,%d,%d,%d", &weight[0],&weight[1],&weight[2],&weight[3]) != N_PRIO
+      || weight[0] < 1 || weight[1] < 1 || weight[2] < 1 || weight[3] < 1)
+    {
+      ERRORPRINTF(t, E_ERROR | 156, "weights must be four positive numbers, e.g. 8,4,2,1");
+      return false;
+    }
+  wrr_pos = 0;
+  wrr_credit = weight[0];
   return true;
 }
 
@@ -68,7 +98,17 @@ QueueFilter::started()
 void
 QueueFilter::stopped(bool err)
 {
-  buf.clear();
+  for (int c = 0; c < N_PRIO; c++)
+    {
+      QueueStats &st = stats[c];
+      st.dropped += buf[c].size();
+      buf[c].clear();
+      if (st.sent || st.dropped)
+        TRACEPRINTF (t, 4, "%s: sent %lu, dropped %lu, max depth %zu; delay <10ms %lu, <100ms %lu, <1s %lu, <10s %lu, more %lu",
+                     prio_names[c], st.sent, st.dropped, st.max_depth,
+                     st.delays[0], st.delays[1], st.delays[2], st.delays[3], st.delays[4]);
+    }
+  depth = 0;
   state = Q_DOWN;
   Filter::stopped(err);
 }
@@ -93,14 +133,48 @@ QueueFilter::send_Next()
     }
 }
 
+int
+QueueFilter::next_class()
+{
+  if (!depth)
+    return -1;
+  if (!weighted)
+    {
+      for (int c = 0; c < N_PRIO; c++)
+        if (!buf[c].empty())
+          return c;
+      return -1;
+    }
+  // Each class may send "weight" telegrams, then it's the next one's turn.
+  // Empty classes forfeit theirs. Terminates because depth > 0.
+  while (buf[wrr_pos].empty() || wrr_credit <= 0)
+    {
+      wrr_pos = (wrr_pos + 1) % N_PRIO;
+      wrr_credit = weight[wrr_pos];
+    }
+  wrr_credit--;
+  return wrr_pos;
+}
+
 void
 QueueFilter::trigger_cb (ev::async &, int)
 {
-  while (!buf.empty() && state == Q_IDLE)
+  int c;
+  while (state == Q_IDLE && (c = next_class()) >= 0)
     {
       state = Q_SENDING;
-      LDataPtr l = buf.get();
-      Filter::send_L_Data(std::move(l));
+      QueuedFrame f = buf[c].get();
+      depth--;
+
+      QueueStats &st = stats[c];
+      timestamp_t delay = getTime() - f.queued;
+      int d = 0;
+      while (d < N_DELAYS && delay >= delay_limits[d])
+        d++;
+      st.delays[d]++;
+      st.sent++;
+
+      Filter::send_L_Data(std::move(f.l));
     }
   if (state == Q_SENDING)
     state = Q_BUSY;
@@ -116,8 +190,32 @@ QueueFilter::send_L_Data (LDataPtr l)
       trigger.send();
     case Q_BUSY:
     case Q_SENDING:
-      buf.emplace(std::move(l));
-      Filter::send_Next();
+      {
+        int c = l->priority & (N_PRIO-1);
+        if (max_depth && depth >= max_depth)
+          {
+            // drop the oldest of the least important telegrams
+            int v = N_PRIO-1;
+            while (buf[v].empty())
+              v--;
+            if (v < c)
+              {
+                TRACEPRINTF (t, 5, "queue full, dropping %s", l->Decode (t));
+                stats[c].dropped++;
+                Filter::send_Next();
+                break;
+              }
+            QueuedFrame f = buf[v].get();
+            TRACEPRINTF (t, 5, "queue full, dropping %s", f.l->Decode (t));
+            stats[v].dropped++;
+            depth--;
+          }
+        buf[c].emplace(QueuedFrame { std::move(l), getTime() });
+        depth++;
+        if (stats[c].max_depth < buf[c].size())
+          stats[c].max_depth = buf[c].size();
+        Filter::send_Next();
+      }
       break;
     default:
       break;
@@ -22,13 +22,26 @@
 This module implements a filter which buffers packets if the driver
 supports it.
 
+There is one queue per KNX priority. They are drained either strictly by
+priority, or by weighted round-robin so that low-priority telegrams
+still get some share of a congested line. When the filter holds
+"max-depth" telegrams, the oldest one of the lowest non-empty priority
+is dropped to make room, unless everything queued is more important
+than the new telegram; then the new one is dropped.
+
 */
 
 #ifndef FQUEUE_H
 #define FQUEUE_H
 #include "link.h"
+#include "lpdu.h"
 #include "queue.h"
 
+/** number of KNX priority classes, see EIB_Priority */
+#define N_PRIO 4
+/** queueing delay histogram: upper bounds of the buckets, in usec */
+#define N_DELAYS 4
+
 enum QSTATE
 {
   Q_DOWN,    // not running
@@ -37,9 +50,41 @@ enum QSTATE
   Q_SENDING, // packet submitted, in send loop
 };
 
+/** a telegram waiting in the queue */
+struct QueuedFrame
+{
+  LDataPtr l;
+  timestamp_t queued;
+};
+
+/** statistics for one priority class */
+struct QueueStats
+{
+  unsigned long sent = 0;
+  unsigned long dropped = 0;
+  size_t max_depth = 0;
+  /** queueing delay, see delay_limits in fqueue.cpp; the last bucket is "more" */
+  unsigned long delays[N_DELAYS+1] = {0,};
+};
+
 FILTER(QueueFilter,queue)
 {
-  Queue < LDataPtr > buf;
+  Queue < QueuedFrame > buf[N_PRIO];
+  QueueStats stats[N_PRIO];
+  /** total number of queued telegrams */
+  size_t depth = 0;
+  /** limit for that, zero if unlimited */
+  size_t max_depth = 0;
+
+  /** use weighted round-robin instead of strict priority? */
+  bool weighted = false;
+  int weight[N_PRIO];
+  /** weighted round-robin: current class and what's left of its share */
+  int wrr_pos = 0;
+  int wrr_credit = 0;
+  /** which class to send from next; -1 if all are empty */
+  int next_class();
+
   enum QSTATE state;
   ev::async trigger;
   void trigger_cb (ev::async &w, int revents);
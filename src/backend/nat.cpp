@@ -17,6 +17,7 @@
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <algorithm>
 #include <unistd.h>
 #include <cerrno>
 #include <fcntl.h>
@@ -24,11 +25,27 @@
 #include "nat.h"
 #include "router.h"
 
+bool
+NatL2Filter::setupTable()
+{
+  int n = cfg->value("max-entries", 1024);
+  if (n < 1)
+    {
+      ERRORPRINTF(t, E_ERROR | 158, "max-entries must be positive");
+      return false;
+    }
+  max_entries = n;
+  revmap.reserve(std::min(max_entries, (size_t)1024));
+  return true;
+}
+
 bool
 NatL2Filter::setup()
 {
   if (!Filter::setup())
     return false;
+  if (!setupTable())
+    return false;
 
   std::string opt = cfg->value("address","");
   if (opt.length() == 0)
@@ -64,13 +81,21 @@ NatL2Filter::~NatL2Filter ()
 {
 }
 
+void
+NatL2Filter::stopped(bool err)
+{
+  TRACEPRINTF (t, 4, "%zu addresses: %lu hits, %lu misses, %lu evicted",
+               revaddr.size(), n_hits, n_misses, n_evictions);
+  Filter::stopped(err);
+}
+
 void
 NatL2Filter::send_L_Data (LDataPtr  l)
 {
   /* Sending a packet to this interface: record address pair, clear source */
   if (l->address_type == IndividualAddress)
     addReverseAddress (l->source_address, l->destination_address);
-  l->source_address = addr;
+  l.mut()->source_address = addr;
   Filter::send_L_Data (std::move(l));
 }
 
@@ -85,38 +110,53 @@ NatL2Filter::recv_L_Data (LDataPtr  l)
       return;
     }
   if (l->address_type == IndividualAddress)
-    l->destination_address = getDestinationAddress (l->source_address);
+    l.mut()->destination_address = getDestinationAddress (l->source_address);
   Filter::recv_L_Data (std::move(l));
 }
 
 void NatL2Filter::addReverseAddress (eibaddr_t src, eibaddr_t dest)
 {
-  ITER(i,revaddr)
-  if (i->dest == dest)
+  auto m = revmap.find(dest);
+  if (m != revmap.end())
     {
+      auto i = m->second;
       if (i->src != src)
         {
           TRACEPRINTF (t, 5, "from %s to %s", FormatEIBAddr (src), FormatEIBAddr (dest));
           i->src = src;
         }
+      revaddr.splice(revaddr.begin(), revaddr, i);
       return;
     }
 
   TRACEPRINTF (t, 5, "from %s to %s", FormatEIBAddr (src), FormatEIBAddr (dest));
-  phys_comm srcdest = (phys_comm)
-  {
-    .src=src, .dest=dest
-  };
-  revaddr.push_back(srcdest);
+  if (revaddr.size() >= max_entries)
+    {
+      // re-use the least recently used entry
+      auto i = std::prev(revaddr.end());
+      TRACEPRINTF (t, 5, "forget %s", FormatEIBAddr (i->dest));
+      revmap.erase(i->dest);
+      revaddr.splice(revaddr.begin(), revaddr, i);
+      n_evictions++;
+    }
+  else
+    revaddr.emplace_front();
+  revaddr.front().src = src;
+  revaddr.front().dest = dest;
+  revmap.emplace(dest, revaddr.begin());
 }
 
 eibaddr_t NatL2Filter::getDestinationAddress (eibaddr_t src)
 {
-  ITER(i,revaddr)
-  if (i->dest == src)
-    return i->src;
-
-  return 0;
+  auto m = revmap.find(src);
+  if (m == revmap.end())
+    {
+      n_misses++;
+      return 0;
+    }
+  n_hits++;
+  revaddr.splice(revaddr.begin(), revaddr, m->second);
+  return m->second->src;
 }
 
 bool
@@ -124,6 +164,8 @@ MapL2Filter::setup()
 {
   if (!Filter::setup())
     return false;
+  if (!setupTable())
+    return false;
 
   auto c = std::dynamic_pointer_cast<LinkConnect>(conn.lock());
   if (c == nullptr)
@@ -150,9 +192,8 @@ MapL2Filter::send_L_Data (LDataPtr  l)
   /* Sending a packet to this interface: reverse-lookup real destination from source */
   if (l->address_type == IndividualAddress)
     {
-      l->destination_address = getDestinationAddress (l->source_address);
-      if (l->destination_address == 0)
-        l->destination_address = addr;
+      eibaddr_t dest = getDestinationAddress (l->source_address);
+      l.mut()->destination_address = dest ? dest : addr;
     }
   Filter::send_L_Data (std::move(l));
 }
@@ -164,7 +205,7 @@ MapL2Filter::recv_L_Data (LDataPtr  l)
   /* Receiving a packet from this interface: record address pair, clear source */
   if (l->address_type == IndividualAddress)
     addReverseAddress (l->source_address, l->destination_address);
-  l->source_address = addr;
+  l.mut()->source_address = addr;
   Filter::recv_L_Data (std::move(l));
 }
 
@@ -20,6 +20,9 @@
 #ifndef NAT_H
 #define NAT_H
 
+#include <list>
+#include <unordered_map>
+
 #include "link.h"
 
 /**
@@ -51,6 +54,8 @@ public:
   void recv_L_Data (LDataPtr l);
   void send_L_Data (LDataPtr l);
 
+  void stopped(bool err);
+
   void addReverseAddress (eibaddr_t src, eibaddr_t dest);
   eibaddr_t getDestinationAddress (eibaddr_t src);
 
@@ -60,7 +65,19 @@ public:
   }
 
 protected:
-  std::vector < phys_comm > revaddr; // TODO: replace with a map
+  /** address pairs, most recently used first */
+  std::list < phys_comm > revaddr;
+  /** dest => its entry in revaddr */
+  std::unordered_map < eibaddr_t, std::list < phys_comm >::iterator > revmap;
+  /** max size of revaddr, the least recently used entry is dropped */
+  size_t max_entries = 1024;
+  /** statistics */
+  unsigned long n_hits = 0;
+  unsigned long n_misses = 0;
+  unsigned long n_evictions = 0;
+
+  /** read the table's options */
+  bool setupTable();
 };
 
 /**
@@ -17,6 +17,8 @@
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include <algorithm>
+#include <cstring>
 #include <unistd.h>
 #include <cerrno>
 #include <fcntl.h>
@@ -25,12 +27,22 @@
 #include "router.h"
 
 #define NO_MAP
+#include "fpace.h"
 #include "nat.h"
 #include "llserial.h"
 #include "lltcp.h"
 #include "log.h"
 #include "cm_tp1.h"
 
+/** tell the pace filter, if any, what we saw on the bus */
+static void
+report(std::weak_ptr<PaceFilter>& pace, enum PACK ack)
+{
+  auto p = pace.lock();
+  if (p != nullptr)
+    p->bus_ack(ack);
+}
+
 class TPUARTserial : public LLserial
 {
 public:
@@ -237,6 +249,7 @@ TPUARTwrap::send_again()
 void
 TPUARTwrap::started()
 {
+  pace = std::dynamic_pointer_cast<PaceFilter>(findFilter("pace"));
   setstate(T_new);
   setstate(T_start);
 }
@@ -261,16 +274,13 @@ TPUARTwrap::RecvLPDU (const uint8_t * data, int len)
     }
   else if (state > T_start)
     {
-      LPDUPtr l = CM_TP1_to_L_Data (CArray (data, len), t);
-      if (l->getType () != L_Data)
-        TRACEPRINTF (t, 1, "dropping packet: type %d", l->getType ());
+      LDataPtr l = CM_TP1_to_L_Data (CArray (data, len), t);
+      if (!l)
+        TRACEPRINTF (t, 1, "dropping packet: not L_Data");
+      else if (l->valid_checksum)
+        recv_L_Data (std::move(l));
       else
-        {
-          if (((L_Data_PDU *)(&*l))->valid_checksum)
-            recv_L_Data (dynamic_unique_cast<L_Data_PDU>(std::move(l)));
-          else
-            TRACEPRINTF (t, 1, "dropping packet: invalid");
-        }
+        TRACEPRINTF (t, 1, "dropping packet: invalid");
     }
 }
 
@@ -334,8 +344,8 @@ TPUARTwrap::timer_cb(ev::timer &, int)
       setstate(T_wait_keepalive);
       break;
     case T_wait_more:
-      t->TracePacket (8, "Incomplete packet", in);
-      in.clear();
+      t->TracePacket (8, "Incomplete packet", in_len, in);
+      in_len = 0;
       setstate(T_wait);
       break;
     case T_wait_keepalive:
@@ -357,12 +367,12 @@ TPUARTwrap::in_check()
 {
   bool ext = !(in[0] & 0x80);
 
-  if (in.size () >= 6u+ext)
+  if (in_need == 6u+ext)
     {
-
+      // The header is complete. Ack it now, the sender is waiting.
       if (!acked && !recvecho && my_addr == 0 && state >= T_is_online && state < T_busmonitor)
         {
-          if (out.size() >= 6u+ext && !((in[0]^out[0])&~0x20) && !memcmp(in.data()+1,out.data()+1,5+ext))
+          if (out.size() >= 6u+ext && !((in[0]^out[0])&~0x20) && !memcmp(in+1,out.data()+1,5+ext))
             recvecho = true;
           else
             {
@@ -383,33 +393,69 @@ TPUARTwrap::in_check()
             }
         }
 
-      unsigned len = ext ? in[6] : (in[5] & 0x0f);
-      len += 6 + ext + 2;
-
-      if (in.size() > len)
-        TRACEPRINTF (t, 8, "Datalen %d has len %d?", len, in.size());
-
-      if (in.size() >= len)
-        {
-          if (!recvecho)
-            RecvLPDU (in.data(), in.size());
-          in.clear();
-        }
+      // now wait for the rest
+      in_need = (ext ? in[6] : (in[5] & 0x0f)) + 6 + ext + 2;
     }
-
-  if (state > T_is_online && state < T_busmonitor)
+  else
     {
-      if (in.size() == 0)
-        setstate(T_wait);
-      else
-        setstate(T_wait_more);
+      if (!recvecho)
+        RecvLPDU (in, in_len);
+      in_len = 0;
     }
 }
 
+/** What a byte from the TPUART means when we're not inside a frame */
+enum TCHAR : uint8_t
+{
+  TC_UNKNOWN,
+  TC_RESET,     // reset indication
+  TC_CON_POS,   // L_DataConfirm positive
+  TC_CON_NEG,   // L_DataConfirm negative
+  TC_IGNORE,    // NCN5120 frame end / frame state indication
+  TC_STATE,     // state indication
+  TC_ACK,       // ACK, NACK or BUSY of some frame on the bus
+  TC_FRAME,     // start of a L_Data frame
+};
+
+static struct TPUARTchars
+{
+  TCHAR cls[256];
+  TPUARTchars()
+  {
+    for (int i = 0; i < 256; i++)
+      {
+        uint8_t c = i;
+        if (c == 0x03)
+          cls[i] = TC_RESET;
+        else if (c == 0x8B)
+          cls[i] = TC_CON_POS;
+        else if (c == 0xCB) // frame end, NCN5120
+          cls[i] = TC_IGNORE;
+        else if (c == 0x0B)
+          cls[i] = TC_CON_NEG;
+        else if ((c & 0x17) == 0x13) // frame state indication, NCN5120
+          cls[i] = TC_IGNORE;
+        else if ((c & 0x07) == 0x07)
+          cls[i] = TC_STATE;
+        /*
+         * 0xCC acknowledge frame
+         * 0x0C NotAcknowledge frame
+         * 0xC0 Busy Frame
+         */
+        else if (c == 0xCC || c == 0xC0 || c == 0x0C)
+          cls[i] = TC_ACK;
+        else if ((c & 0x50) == 0x10) // Matches KNX control byte L_Data_Standard/Extended Frame
+          cls[i] = TC_FRAME;
+        else
+          cls[i] = TC_UNKNOWN;
+      }
+  }
+} tpuart_chars;
+
 void
 TPUARTwrap::recv_Data(CArray &c)
 {
-  uint8_t *buf = c.data();
+  const uint8_t *buf = c.data();
   size_t len = c.size();
 
   if (state < T_start)
@@ -418,23 +464,39 @@ TPUARTwrap::recv_Data(CArray &c)
       return; // discard
     }
 
-  while(len--)
+  while(len)
     {
-      uint8_t c = *buf++;
-      if (in.size() > 0)
+      if (in_len > 0)
         {
-          in.setpart (&c, in.size(), 1);
-          in_check();
+          // Inside a frame: take as much of it as we have
+          size_t n = std::min(len, (size_t)(in_need - in_len));
+          memcpy (in + in_len, buf, n);
+          in_len += n;
+          buf += n;
+          len -= n;
+          if (in_len == in_need)
+            in_check();
+          if (state > T_is_online && state < T_busmonitor)
+            {
+              if (in_len == 0)
+                setstate(T_wait);
+              else
+                setstate(T_wait_more);
+            }
           continue;
         }
+
+      uint8_t c = *buf++;
+      len--;
       if (skip_char)
         {
           skip_char = false;
           continue;
         }
 
-      if (c == 0x03) // RESET
+      switch(tpuart_chars.cls[c])
         {
+        case TC_RESET:
           if (state == T_in_reset)
             {
               TRACEPRINTF (t, 8, "RESET_ACK");
@@ -442,33 +504,32 @@ TPUARTwrap::recv_Data(CArray &c)
             }
           else
             TRACEPRINTF (t, 8, "spurious RESET_ACK");
-        }
-      else if (c == 0x8B) // L_DataConfirm positive
-        {
+          break;
+
+        case TC_CON_POS:
           if (out.size() == 0 || state < T_is_online)
             {
               TRACEPRINTF (t, 8, "ACK: but not sending");
-              continue;
+              break;
             }
+          report(pace, PA_ACK);
           do__send_Next();
-          continue;
-        }
-      else if (c == 0xCB) // frame end, NCN5120
-        { }
-      else if (c == 0x0B) // L_DataConfirm negative
-        {
+          break;
+
+        case TC_CON_NEG:
           if (out.size() == 0 || state < T_is_online)
             {
               TRACEPRINTF (t, 8, "NACK: but not sending");
-              continue;
+              break;
             }
+          report(pace, PA_NACK);
           do__send_Next();
-          continue;
-        }
-      else if ((c & 0x17) == 0x13) // frame state indication, NCN5120
-        { }
-      else if ((c & 0x07) == 0x07) // state indication
-        {
+          break;
+
+        case TC_IGNORE:
+          break;
+
+        case TC_STATE:
           TRACEPRINTF (t, 8, "State: %02X", c);
           if (c != 0x07)
             ERRORPRINTF (t, E_WARNING | 116, "TPUART error state x%02X", c);
@@ -497,25 +558,26 @@ TPUARTwrap::recv_Data(CArray &c)
               ERRORPRINTF (t, E_WARNING | 117, "TPUART state %s should not happen", SN(state));
               break;
             }
-        }
-      /*
-        * 0xCC acknowledge frame
-        * 0x0C NotAcknowledge frame
-        * 0xC0 Busy Frame
-        */
-      else if (c == 0xCC || c == 0xC0 || c == 0x0C)
-        {
-          RecvLPDU (in.data(), 1);
-        }
-      else if ((c & 0x50) == 0x10) // Matches KNX control byte L_Data_Standard/Extended Frame
-        {
-          assert(!in.size());
-          in.setpart (&c, in.size(), 1);
-        }
-      else
-        {
+          break;
+
+        case TC_ACK:
+          if (c == 0xC0)
+            report(pace, PA_BUSY);
+          else if (c == 0x0C)
+            report(pace, PA_NACK_OTHER);
+          RecvLPDU (&c, 1);
+          break;
+
+        case TC_FRAME:
+          in[0] = c;
+          in_len = 1;
+          in_need = (c & 0x80) ? 6 : 7; // standard or extended header
+          break;
+
+        default:
           acked = false;
           TRACEPRINTF (t, 0, "unknown %02X", c);
+          break;
         }
     }
   return;
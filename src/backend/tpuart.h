@@ -25,6 +25,11 @@
 #include "lpdu.h"
 #include "lowlevel.h"
 
+class PaceFilter;
+
+/** longest frame: extended header, 255 bytes payload, TPCI, checksum */
+#define TPUART_MAX_FRAME (6+1+255+2)
+
 // also update SN() in tpuart.cpp
 enum TSTATE
 {
@@ -73,6 +78,7 @@ protected:
   virtual void do_send_Next();
   void do__send_Next();
   void send_again();
+  /** in[] holds in_need bytes */
   void in_check();
 
   /** OK to send next packet */
@@ -87,7 +93,12 @@ protected:
   void sendtimer_cb(ev::timer &w, int revents);
 
   LPDUPtr sending;
-  CArray in, out;
+  CArray out;
+  /** the frame being received. First we collect the header, which tells
+   * us the length, then the rest. */
+  uint8_t in[TPUART_MAX_FRAME];
+  unsigned in_len = 0;
+  unsigned in_need = 0;
   unsigned int retry = 0;
   unsigned int send_retry = 0;
   bool acked = false;
@@ -99,6 +110,9 @@ protected:
   enum TSTATE state = T_new;
   virtual void setstate(enum TSTATE new_state);
 
+  /** a "pace" filter on this link which wants to know about ACK/NACK/BUSY */
+  std::weak_ptr<PaceFilter> pace;
+
 public:
   bool setup();
   void started();
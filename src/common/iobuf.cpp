@@ -21,15 +21,47 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include "iobuf.h"
 
+/** max number of buffers per writev() call */
+#define SENDBUF_IOV 64
+
+/** initial and maximum size of the receive buffer. The maximum must
+ * hold the largest client message (64k plus the length header). */
+#define RECVBUF_MIN 1024
+#define RECVBUF_MAX (128*1024)
+
+bool
+parseQueuePolicy(const std::string &name, QueuePolicy &policy)
+{
+  if (name == "disconnect")
+    policy = QP_DISCONNECT;
+  else if (name == "drop-oldest")
+    policy = QP_DROP_OLDEST;
+  else if (name == "drop-newest")
+    policy = QP_DROP_NEWEST;
+  else
+    return false;
+  return true;
+}
+
 void SendBuf::write(const CArray *data)
 {
+  if (overflow)
+    {
+      n_dropped++;
+      delete data;
+      return;
+    }
   if (!ready)
     {
       ssize_t len = ::write(fd, data->data(), data->size());
+      if (len > 0)
+        n_writes++;
       if (len == (ssize_t)data->size())
         {
+          n_sent++;
           delete data;
           return;
         }
@@ -37,7 +69,36 @@ void SendBuf::write(const CArray *data)
       sendpos = (len>0) ? len : 0;
     }
   else
-    sendqueue.push(data);
+    {
+      if (full(data->size()))
+        switch (policy)
+          {
+          case QP_DISCONNECT:
+            overflow = true;
+            n_dropped++;
+            delete data;
+            overflow_trigger.send();
+            return;
+          case QP_DROP_NEWEST:
+            n_dropped++;
+            delete data;
+            return;
+          case QP_DROP_OLDEST:
+            while (!sendqueue.empty() && full(data->size()))
+              {
+                const CArray *old = sendqueue.front();
+                sendqueue.pop_front();
+                sendbytes -= old->size();
+                n_dropped++;
+                delete old;
+              }
+            break;
+          }
+      sendqueue.push_back(data);
+      sendbytes += data->size();
+      if (max_queued < sendbytes)
+        max_queued = sendbytes;
+    }
   if (!ready)
     {
       ready = true;
@@ -50,51 +111,98 @@ SendBuf::io_cb (ev::io &, int)
 {
   while (sendbuf || !sendqueue.empty())
     {
-      if (sendbuf)
+      if (!sendbuf)
         {
-          int i = ::write(fd,sendbuf->data()+sendpos, sendbuf->size()-sendpos);
-          if (i > 0)
-            {
-              sendpos += i;
-              if (sendpos < sendbuf->size())
-                return;
-            }
-          else
+          sendbuf = sendqueue.front();
+          sendqueue.pop_front();
+          sendbytes -= sendbuf->size();
+          sendpos = 0;
+        }
+
+      // Hand the partially-sent buffer and as much of the queue as
+      // possible to the kernel in one go
+      struct iovec iov[SENDBUF_IOV];
+      int n = 1;
+      iov[0].iov_base = const_cast<uint8_t *>(sendbuf->data()) + sendpos;
+      iov[0].iov_len = sendbuf->size() - sendpos;
+      size_t offered = iov[0].iov_len;
+      for (auto i = sendqueue.begin(); n < SENDBUF_IOV && i != sendqueue.end(); ++i, ++n)
+        {
+          iov[n].iov_base = const_cast<uint8_t *>((*i)->data());
+          iov[n].iov_len = (*i)->size();
+          offered += iov[n].iov_len;
+        }
+
+      ssize_t i = ::writev(fd, iov, n);
+      if (i <= 0)
+        {
+          if (i == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
             {
-              if (i == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
-                {
-                  io.stop();
-                  on_error();
-                }
-              return;
+              io.stop();
+              on_error();
             }
+          return;
         }
+      n_writes++;
 
-      delete sendbuf;
-      sendbuf = nullptr;
-
-      if (!sendqueue.empty())
+      size_t done = i;
+      while (done >= sendbuf->size() - sendpos)
         {
-          sendbuf = sendqueue.get();
+          done -= sendbuf->size() - sendpos;
+          n_sent++;
+          delete sendbuf;
+          sendbuf = nullptr;
+          if (sendqueue.empty())
+            break;
+          sendbuf = sendqueue.front();
+          sendqueue.pop_front();
+          sendbytes -= sendbuf->size();
           sendpos = 0;
         }
+      if (sendbuf)
+        sendpos += done;
+      if ((size_t)i < offered)
+        return; // the socket is full; wait for the next callback
     }
   ready = false;
   io.stop();
   on_next();
 }
 
+bool
+RecvBuf::make_room()
+{
+  if (recvpos < recvbuf.size())
+    return true;
+  if (recvstart > 0)
+    {
+      // Only the tail of an incomplete message is left, so this is cheap
+      recvpos -= recvstart;
+      memmove(recvbuf.data(), recvbuf.data()+recvstart, recvpos);
+      recvstart = 0;
+      return true;
+    }
+  if (recvbuf.size() >= RECVBUF_MAX)
+    return false;
+  recvbuf.resize(recvbuf.size() ? recvbuf.size() * 2 : RECVBUF_MIN);
+  return true;
+}
+
 void
 RecvBuf::io_cb (ev::io &, int)
 {
-  bool some = false;
-  while(sizeof(recvbuf) > recvpos)
+  while (true)
     {
-      int i = ::read(fd, recvbuf+recvpos, quick ? 1 : (sizeof(recvbuf)-recvpos));
+      if (!make_room())
+        {
+          io.stop();
+          on_error();
+          return;
+        }
+      size_t room = recvbuf.size() - recvpos;
+      int i = ::read(fd, recvbuf.data()+recvpos, room);
       if (i <= 0)
         {
-          if (some)
-            break;
           if (i == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
             {
               io.stop();
@@ -103,36 +211,26 @@ RecvBuf::io_cb (ev::io &, int)
           break;
         }
       recvpos += i;
-      if (!quick)
+      feed_out();
+      // In low-latency mode, drain the descriptor: a serial line may
+      // have more bytes than fit into the buffer. Otherwise the next
+      // callback picks up the rest.
+      if (!quick || (size_t)i < room || !running)
         break;
-      some = true;
     }
-  feed_out();
 }
 
 void RecvBuf::feed_out()
 {
-  while (running && recvpos > 0)
+  while (running && recvpos > recvstart)
     {
-      size_t i = on_read(recvbuf,recvpos);
+      size_t i = on_read(recvbuf.data()+recvstart, recvpos-recvstart);
       if (i == 0)
-        {
-          if (recvpos == sizeof(recvbuf))
-            {
-              io.stop();
-              on_error();
-            }
-          return;
-        }
-      if (i == recvpos)
-        recvpos = 0;
-      else
-        {
-          recvpos -= i;
-          memmove(recvbuf,recvbuf+i,recvpos);
-        }
+        break;
+      recvstart += i;
     }
-
+  if (recvstart == recvpos)
+    recvstart = recvpos = 0;
 }
 
 void
@@ -155,10 +253,18 @@ RecvBuf::start()
   feed_out();
 }
 
+void
+SendBuf::overflow_cb (ev::async &, int)
+{
+  io.stop();
+  on_error();
+}
+
 void
 SendBuf::start()
 {
   io.start(fd, ev::WRITE);
+  overflow_trigger.start();
 }
 
 void
@@ -175,6 +281,7 @@ void
 SendBuf::stop(bool clear)
 {
   io.stop();
+  overflow_trigger.stop();
   if (clear)
     fd = -1;
 }
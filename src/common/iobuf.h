@@ -28,11 +28,22 @@
 #include "callbacks.h"
 #include <cassert>
 #include <ev++.h>
-#include <queue.h>
+#include <deque>
 #include <cerrno>
 
 void set_non_blocking(int fd);
 
+/** what to do when a send queue is full */
+enum QueuePolicy
+{
+  QP_DISCONNECT,  //< close the connection
+  QP_DROP_OLDEST, //< discard the oldest queued message
+  QP_DROP_NEWEST, //< discard the new message
+};
+
+/** parse a queue policy name; returns false if unknown */
+bool parseQueuePolicy(const std::string &name, QueuePolicy &policy);
+
 class SendBuf
 {
 public:
@@ -54,17 +65,15 @@ public:
     set_non_blocking(fd);
     this->fd = fd;
     io.set<SendBuf, &SendBuf::io_cb>(this);
+    overflow_trigger.set<SendBuf, &SendBuf::overflow_cb>(this);
     on_error.set<SendBuf,&SendBuf::error_cb>(this);
     on_next.set<SendBuf,&SendBuf::next_cb>(this);
   };
 
   virtual ~SendBuf()
   {
-    while (!sendqueue.empty())
-      {
-        const CArray *buf = sendqueue.get();
-        delete buf;
-      }
+    ITER(i, sendqueue)
+      delete *i;
     if (sendbuf)
       delete sendbuf;
   };
@@ -80,6 +89,31 @@ public:
 
   void write(const CArray *data);
 
+  /** limit the queue to this many bytes / messages; zero: no limit */
+  void set_limits(size_t max_bytes, unsigned max_msgs, QueuePolicy policy)
+  {
+    this->max_bytes = max_bytes;
+    this->max_msgs = max_msgs;
+    this->policy = policy;
+  }
+
+  /** statistics */
+  unsigned long n_sent = 0;
+  unsigned long n_dropped = 0;
+  unsigned long n_writes = 0;
+  size_t max_queued = 0;
+  /** set when the queue overflowed with QP_DISCONNECT */
+  bool overflow = false;
+
+  size_t queued_bytes() const
+  {
+    return sendbytes;
+  }
+  size_t queued_msgs() const
+  {
+    return sendqueue.size();
+  }
+
 protected:
   /** client connection */
   int fd = -1;
@@ -87,12 +121,26 @@ protected:
   /** sending */
   const CArray *sendbuf = nullptr;
   unsigned sendpos;
-  Queue <const CArray *> sendqueue;
+  std::deque <const CArray *> sendqueue;
+  /** bytes in sendqueue */
+  size_t sendbytes = 0;
   bool ready = false;
 
+  size_t max_bytes = 0;
+  unsigned max_msgs = 0;
+  QueuePolicy policy = QP_DISCONNECT;
+
 private:
   ev::io io;
   void io_cb (ev::io &w, int revents);
+  /** reports an overflow from the main loop, not from within write() */
+  ev::async overflow_trigger;
+  void overflow_cb (ev::async &w, int revents);
+  bool full(size_t len) const
+  {
+    return (max_msgs && sendqueue.size() >= max_msgs) ||
+           (max_bytes && sendbytes + len > max_bytes);
+  }
 };
 
 class RecvBuf
@@ -137,11 +185,13 @@ protected:
   /** client connection */
   int fd = -1;
 
-  /** receiving */
-  uint8_t recvbuf[1024];
+  /** receiving. Unprocessed data is recvbuf[recvstart..recvpos). */
+  CArray recvbuf;
+  size_t recvstart = 0;
   size_t recvpos = 0;
-  int len = 0; // of current block
   void feed_out();
+  /** make sure that there's free space after recvpos */
+  bool make_room();
 
 private:
   ev::io io;
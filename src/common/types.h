@@ -21,11 +21,15 @@
 #define TYPES_H
 
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 
-#include <vector>
-#include <string>
+#include <algorithm>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <string>
+#include <vector>
 
 #include "config.h"
 
@@ -53,60 +57,295 @@ inline unsigned int _min(const unsigned int _a, const unsigned int _b)
 /*
  * byte arrays however need some help.
  * We can't use strings: strings can't contain null characters.
+ *
+ * Almost all KNX frames are short, so CArray keeps up to
+ * CArray::inline_size bytes inside the object and only goes to the heap
+ * for longer data. Its interface is the subset of std::vector<uint8_t>
+ * which knxd uses.
  */
 
 using u8vec = std::vector<uint8_t>; // less typing
 
-class CArray : public u8vec
+class CArray
 {
 public:
+  typedef uint8_t value_type;
+  typedef size_t size_type;
+  typedef uint8_t &reference;
+  typedef const uint8_t &const_reference;
+  typedef uint8_t *iterator;
+  typedef const uint8_t *const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  /** bytes stored without a heap allocation */
+  static constexpr size_type inline_size = 32;
+
   /** start with various initializers */
-  CArray() : u8vec() { }
-  CArray(const CArray& __str, size_type __pos) : u8vec(_sub(__pos,__str.size()))
+  CArray() { }
+  explicit CArray(size_type __n)
+  {
+    resize(__n);
+  }
+  CArray(const CArray& __str)
+  {
+    set (__str.data(), __str.size());
+  }
+  CArray(CArray&& __str) noexcept
+  {
+    take (__str);
+  }
+  CArray(const CArray& __str, size_type __pos)
+  {
+    if (__pos < __str.size())
+      set (__str.data()+__pos, __str.size()-__pos);
+  }
+  CArray(const CArray& __str, size_type __pos, size_type __n)
+  {
+    if (__pos < __str.size())
+      set (__str.data()+__pos, _min(__n,__str.size()-__pos));
+  }
+  CArray(const uint8_t *__str, size_type __pos, size_type __n)
+  {
+    set (__str+__pos, __n);
+  }
+  CArray(const uint8_t *__str, size_type __n)
+  {
+    set (__str, __n);
+  }
+  template<class I>
+  CArray(I __first, I __last)
+  {
+    insert (end(), __first, __last);
+  }
+  CArray(const u8vec& __v)
+  {
+    set (__v.data(), __v.size());
+  }
+  ~CArray()
+  {
+    if (_data != _buf)
+      free (_data);
+  }
+
+  CArray& operator= (const CArray& __str)
+  {
+    if (this != &__str)
+      set (__str.data(), __str.size());
+    return *this;
+  }
+  CArray& operator= (CArray&& __str) noexcept
+  {
+    if (this != &__str)
+      {
+        if (_data != _buf)
+          free (_data);
+        take (__str);
+      }
+    return *this;
+  }
+
+  /** vector-ish accessors */
+  size_type size() const
+  {
+    return _size;
+  }
+  size_type capacity() const
+  {
+    return _cap;
+  }
+  bool empty() const
+  {
+    return _size == 0;
+  }
+  uint8_t *data()
+  {
+    return _data;
+  }
+  const uint8_t *data() const
+  {
+    return _data;
+  }
+  iterator begin()
+  {
+    return _data;
+  }
+  iterator end()
+  {
+    return _data+_size;
+  }
+  const_iterator begin() const
+  {
+    return _data;
+  }
+  const_iterator end() const
+  {
+    return _data+_size;
+  }
+  const_iterator cbegin() const
+  {
+    return _data;
+  }
+  const_iterator cend() const
+  {
+    return _data+_size;
+  }
+  reverse_iterator rbegin()
   {
-    CArray::iterator j = this->begin();
-    const uint8_t *str = __str.data()+__pos;
-    for(unsigned int i = this->size(); i > 0; i--,j++)
-      *j = *str++;
+    return reverse_iterator(end());
   }
-  CArray(const CArray& __str, size_type __pos, size_type __n) : u8vec(_min(__n,_sub(__pos,__str.size())))
+  reverse_iterator rend()
   {
-    CArray::iterator j = this->begin();
-    const uint8_t *str = __str.data()+__pos;
-    while(j != this->end())
-      *j++ = *str++;
+    return reverse_iterator(begin());
   }
-  CArray(const uint8_t *__str, size_type __pos, size_type __n) : u8vec(__n)
+  const_reverse_iterator crbegin() const
   {
-    CArray::iterator j = this->begin();
-    __str += __pos;
-    for(unsigned int i = __pos; j != this->end(); i++,j++)
-      *j = *__str++;
+    return const_reverse_iterator(end());
   }
-  CArray(const uint8_t *__str, size_type __n) : u8vec(__n)
+  const_reverse_iterator crend() const
   {
-    CArray::iterator j = this->begin();
-    while(j != this->end())
-      *j++ = *__str++;
+    return const_reverse_iterator(begin());
+  }
+  uint8_t& operator[] (size_type __i)
+  {
+    return _data[__i];
+  }
+  const uint8_t& operator[] (size_type __i) const
+  {
+    return _data[__i];
+  }
+  uint8_t& front()
+  {
+    return _data[0];
+  }
+  const uint8_t& front() const
+  {
+    return _data[0];
+  }
+  uint8_t& back()
+  {
+    return _data[_size-1];
+  }
+  const uint8_t& back() const
+  {
+    return _data[_size-1];
+  }
+
+  /** make room for at least cnt bytes */
+  void reserve (size_type cnt)
+  {
+    if (cnt <= _cap)
+      return;
+    size_type ncap = _cap * 2;
+    if (ncap < cnt)
+      ncap = cnt;
+    uint8_t *nd = (uint8_t *)malloc (ncap);
+    if (!nd)
+      throw std::bad_alloc();
+    memcpy (nd, _data, _size);
+    if (_data != _buf)
+      free (_data);
+    _data = nd;
+    _cap = ncap;
+  }
+  /** new bytes are zeroed, as with std::vector */
+  void resize (size_type cnt, uint8_t val = 0)
+  {
+    if (cnt > _size)
+      {
+        reserve (cnt);
+        memset (_data+_size, val, cnt-_size);
+      }
+    _size = cnt;
+  }
+  void clear()
+  {
+    _size = 0;
+  }
+  void push_back (uint8_t c)
+  {
+    if (_size == _cap)
+      reserve (_size+1);
+    _data[_size++] = c;
+  }
+  void pop_back ()
+  {
+    _size--;
+  }
+
+  iterator insert (const_iterator __pos, uint8_t c)
+  {
+    return insert (__pos, &c, &c+1);
+  }
+  iterator insert (const_iterator __pos, size_type __n, uint8_t c)
+  {
+    size_type off = __pos - _data;
+    _open (off, __n);
+    memset (_data+off, c, __n);
+    return _data+off;
+  }
+  template<class I>
+  iterator insert (const_iterator __pos, I __first, I __last)
+  {
+    size_type off = __pos - _data;
+    size_type cnt = std::distance (__first, __last);
+    _open (off, cnt);
+    std::copy (__first, __last, _data+off);
+    return _data+off;
+  }
+  iterator erase (const_iterator __pos)
+  {
+    return erase (__pos, __pos+1);
+  }
+  iterator erase (const_iterator __first, const_iterator __last)
+  {
+    size_type off = __first - _data;
+    size_type cnt = __last - __first;
+    memmove (_data+off, _data+off+cnt, _size-off-cnt);
+    _size -= cnt;
+    return _data+off;
+  }
+  template<class I>
+  void assign (I __first, I __last)
+  {
+    clear();
+    insert (end(), __first, __last);
+  }
+  void swap (CArray &a)
+  {
+    CArray tmp (std::move(a));
+    a = std::move(*this);
+    *this = std::move(tmp);
+  }
+
+  bool operator== (const CArray &a) const
+  {
+    return _size == a._size && !memcmp (_data, a._data, _size);
+  }
+  bool operator!= (const CArray &a) const
+  {
+    return !(*this == a);
+  }
+  bool operator< (const CArray &a) const
+  {
+    int r = memcmp (_data, a._data, _min(_size, a._size));
+    return r ? (r < 0) : (_size < a._size);
   }
 
   /** set me to a C array */
   void set (const uint8_t *elem, unsigned cnt)
   {
-    this->resize(cnt);
-    CArray::iterator j = this->begin();
-    while(j != this->end())
-      *j++ = *elem++;
+    _size = 0;
+    reserve (cnt);
+    if (cnt)
+      memmove (_data, elem, cnt);
+    _size = cnt;
   }
 
   /** copy content. Should be equivalent to operator= */
   void set (const CArray & a)
   {
-    this->resize(a.size());
-    CArray::const_iterator i = a.begin();
-    CArray::iterator j = this->begin();
-    while (i != a.end())
-      *j++ = *i++;
+    *this = a;
   }
 
   /**
@@ -119,10 +358,8 @@ public:
   {
     if (cnt + start > size())
       resize (cnt + start);
-
-    CArray::iterator i = this->begin()+start;
-    while(cnt--)
-      *i++ = *elem++;
+    if (cnt)
+      memmove (_data+start, elem, cnt);
   }
 
   /** setpart for a string. This copies the terminal null character, */
@@ -134,7 +371,7 @@ public:
   /** why doesn't std::vector have this?? */
   void operator+= (const CArray &a)
   {
-    insert(end(), a.begin(), a.end());
+    setpart (a.data(), _size, a.size());
   }
 
   /**
@@ -163,6 +400,40 @@ public:
       return;
     erase (this->begin()+start,this->begin()+start+cnt);
   }
+
+private:
+  uint8_t *_data = _buf;
+  size_type _size = 0;
+  size_type _cap = inline_size;
+  uint8_t _buf[inline_size];
+
+  /** steal a's buffer, or copy its inline data */
+  void take (CArray &a)
+  {
+    if (a._data == a._buf)
+      {
+        _data = _buf;
+        _cap = inline_size;
+        memcpy (_buf, a._buf, a._size);
+      }
+    else
+      {
+        _data = a._data;
+        _cap = a._cap;
+        a._data = a._buf;
+        a._cap = inline_size;
+      }
+    _size = a._size;
+    a._size = 0;
+  }
+
+  /** make a gap of cnt bytes at off */
+  void _open (size_type off, size_type cnt)
+  {
+    reserve (_size+cnt);
+    memmove (_data+off+cnt, _data+off, _size-off);
+    _size += cnt;
+  }
 };
 
 template <typename To, typename From>
@@ -868,6 +868,46 @@ int EIB_Cache_LastUpdates2 (EIBConnection * con, uint32_t start,
                             uint8_t timeout, int max_len, uint8_t * buf,
                             uint32_t * end);
 
+/** Query the cached values of several group addresses at once
+ * \param con eibd connection
+ * \param age ignore values older than age seconds (0: any age)
+ * \param flags bit 0: send A_GroupValue_Read for addresses without
+ *        a (recent enough) value, in ranges of at most 256 addresses.
+ *        At most 256 reads are sent per request, for the lowest
+ *        addresses; repeat the request later to read the rest.
+ * \param ranges_len length of ranges
+ * \param ranges list of address ranges: first and last group address
+ *        (2 bytes each, both included). They may overlap.
+ * \param max_len buffer size
+ * \param buf buffer for the returned records, in ascending order of
+ *        group address, each address once: group address (2 bytes),
+ *        source address (2), age in seconds (2), APDU length (1), APDU
+ * \param next if the reply was too long, the group address to continue
+ *        at, else 0. Repeat the request with every range's start raised
+ *        to at least next (dropping ranges which end before it).
+ * \return -1 if error (ENODEV=group cache not enabled), else number of bytes read
+ */
+int EIB_Cache_ReadMulti (EIBConnection * con, uint16_t age, uint8_t flags,
+                         int ranges_len, const uint8_t * ranges,
+                         int max_len, uint8_t * buf, uint16_t * next);
+
+/** Returns the values of the last updates in the groupcache, oldest first.
+ * Each record is: sequence number (4 bytes), group address (2),
+ * source address (2), age in seconds (2), APDU length (1), APDU.
+ * If not all changes fit into one reply, end is the sequence number of
+ * the first one missing.
+ * \param con eibd connection
+ * \param start start position (use 0 for first request)
+ * \param timeout maximum time to wait in seconds, if there is no data
+ * \param max_len buffer size
+ * \param buf buffer for the returned records
+ * \param end position for the next request
+ * \return -1 if error, else number of bytes read
+ */
+int EIB_Cache_LastValues (EIBConnection * con, uint32_t start,
+                          uint8_t timeout, int max_len, uint8_t * buf,
+                          uint32_t * end);
+
 /** Enable Group Cache - asynchronous.
  * \param con eibd connection
  * \return 0 if started, -1 if error
@@ -934,6 +974,35 @@ int EIB_Cache_LastUpdates2_async (EIBConnection * con, uint32_t start,
                                   uint8_t timeout, int max_len, uint8_t * buf,
                                   uint32_t * end);
 
+/** Query the cached values of several group addresses at once - asynchronous.
+ * \param con eibd connection
+ * \param age ignore values older than age seconds (0: any age)
+ * \param flags see EIB_Cache_ReadMulti
+ * \param ranges_len length of ranges
+ * \param ranges list of address ranges, see EIB_Cache_ReadMulti
+ * \param max_len buffer size
+ * \param buf buffer for the returned records
+ * \param next group address to continue at, or 0
+ * \return 0 if started, -1 if error
+ */
+int EIB_Cache_ReadMulti_async (EIBConnection * con, uint16_t age,
+                               uint8_t flags, int ranges_len,
+                               const uint8_t * ranges, int max_len,
+                               uint8_t * buf, uint16_t * next);
+
+/** Returns the values of the last updates in the groupcache - asynchronous.
+ * \param con eibd connection
+ * \param start start position (use 0 for first request)
+ * \param timeout maximum time to wait in seconds, if there is no data
+ * \param max_len buffer size
+ * \param buf buffer for the returned records, see EIB_Cache_LastValues
+ * \param end position for the next request
+ * \return 0 if started, -1 if error
+ */
+int EIB_Cache_LastValues_async (EIBConnection * con, uint32_t start,
+                                uint8_t timeout, int max_len, uint8_t * buf,
+                                uint32_t * end);
+
 
 __END_DECLS
 #endif
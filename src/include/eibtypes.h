@@ -88,5 +88,17 @@
 #define EIB_CACHE_LAST_UPDATES          0x0076
 #define EIB_CACHE_LAST_UPDATES_2        0x0077
 // like last_updates but 32bit counter
+#define EIB_CACHE_LAST_VALUES           0x0078
+// like last_updates_2 but returns the cached values
+#define EIB_CACHE_READ_MULTI            0x0079
+
+// Multiplexing: after EIB_MUX_ENABLE, every message in either direction
+// is prefixed with a 2-byte session id. Session 0 is the connection
+// itself; EIB_MUX_OPEN / EIB_MUX_CLOSE (with the id as argument) on
+// session 0 create and remove the others, which behave like separate
+// connections.
+#define EIB_MUX_ENABLE                  0x0080
+#define EIB_MUX_OPEN                    0x0081
+#define EIB_MUX_CLOSE                   0x0082
 
 #endif
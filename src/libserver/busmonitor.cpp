@@ -94,34 +94,34 @@ A_Busmonitor::setup (uint8_t *buf, size_t len)
 }
 
 void
-A_Busmonitor::send_L_Busmonitor (LBusmonPtr p)
+A_Busmonitor::send_L_Busmonitor (const L_Busmon_PDU & p)
 {
   CArray buf;
   if (ts)
     {
       buf.resize (7);
       EIBSETTYPE (buf, EIB_BUSMONITOR_PACKET_TS);
-      buf[2] = p->l_status;
-      buf[3] = (p->time_stamp >> 24) & 0xff;
-      buf[4] = (p->time_stamp >> 16) & 0xff;
-      buf[5] = (p->time_stamp >> 8) & 0xff;
-      buf[6] = (p->time_stamp) & 0xff;
+      buf[2] = p.l_status;
+      buf[3] = (p.time_stamp >> 24) & 0xff;
+      buf[4] = (p.time_stamp >> 16) & 0xff;
+      buf[5] = (p.time_stamp >> 8) & 0xff;
+      buf[6] = (p.time_stamp) & 0xff;
     }
   else
     {
       buf.resize (2);
       EIBSETTYPE (buf, EIB_BUSMONITOR_PACKET);
     }
-  buf += p->lpdu;
+  buf += p.lpdu;
 
   con->sendmessage (buf.size(), buf.data());
 }
 
 void
-A_Text_Busmonitor::send_L_Busmonitor (LBusmonPtr p)
+A_Text_Busmonitor::send_L_Busmonitor (const L_Busmon_PDU & p)
 {
   CArray buf;
-  std::string s = p->Decode (t);
+  std::string s = p.Decode (t);
   buf.resize (2 + s.length() + 1);
   EIBSETTYPE (buf, EIB_BUSMONITOR_PACKET);
   buf.setpart ((uint8_t *)s.c_str(), 2, s.length()+1);
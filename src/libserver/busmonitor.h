@@ -51,7 +51,7 @@ public:
   virtual void start() override;
   virtual void stop(bool err) override;
 
-  void send_L_Busmonitor (LBusmonPtr l);
+  void send_L_Busmonitor (const L_Busmon_PDU & l);
   // dummy method
   virtual void recv_Data(uint8_t *, size_t) override {}
 
@@ -86,7 +86,7 @@ public:
   {
     t->setAuxName("TBusMon");
   }
-  void send_L_Busmonitor (LBusmonPtr l);
+  void send_L_Busmonitor (const L_Busmon_PDU & l);
 };
 
 #endif
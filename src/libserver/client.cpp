@@ -50,6 +50,17 @@ ClientConnection::ClientConnection (NetServerPtr s, int fd) : router(static_cast
   recvbuf.on_read.set<ClientConnection,&ClientConnection::read_cb>(this);
   recvbuf.on_error.set<ClientConnection,&ClientConnection::error_cb>(this);
   sendbuf.on_error.set<ClientConnection,&ClientConnection::error_cb>(this);
+  sendbuf.set_limits(s->queue_bytes, s->queue_msgs, s->queue_policy);
+}
+
+ClientConnection::ClientConnection (ClientConnection *parent)
+  : router(parent->router)
+{
+  t = TracePtr(new Trace(*(parent->t)));
+  t->setAuxName("CSess");
+  server = parent->server;
+  this->addr = router.get_client_addr(this->t);
+  this->fd = -1;
 }
 
 ClientConnection::~ClientConnection ()
@@ -62,6 +73,9 @@ ClientConnection::~ClientConnection ()
 void
 ClientConnection::error_cb ()
 {
+  if (sendbuf.overflow)
+    ERRORPRINTF (t, E_WARNING | 152, "send queue full (%d messages, %d bytes), disconnecting",
+                 sendbuf.queued_msgs(), sendbuf.queued_bytes());
   stop(true);
 }
 
@@ -95,11 +109,17 @@ ClientConnection::stop(bool err)
 {
   if (addr)
     {
-      TRACEPRINTF (t, 8, "ClientConnection %s closing", FormatEIBAddr (addr));
+      TRACEPRINTF (t, 8, "ClientConnection %s closing: sent %d in %d writes, dropped %d, max queued %d bytes",
+                   FormatEIBAddr (addr), sendbuf.n_sent, sendbuf.n_writes, sendbuf.n_dropped, sendbuf.max_queued);
       Router *router = static_cast<Router *>(&server->router);
       router->release_client_addr(addr);
       addr = 0;
     }
+  while (!sessions.empty())
+    {
+      sessions.begin()->second->stop(err);
+      sessions.erase(sessions.begin());
+    }
   exit_conn();
   server->deregister(shared_from_this());
 
@@ -141,6 +161,47 @@ ClientConnection::read_cb (uint8_t *buf, size_t len)
   buf += 2;
   t->TracePacket (0, "ReadMessage", xlen, buf);
 
+  if (mux)
+    {
+      if (xlen < 4)
+        {
+          sendreject ();
+          return xlen+2;
+        }
+      uint16_t session = (buf[0] << 8) | buf[1];
+      int msg = EIBTYPE (buf+2);
+      if (session == 0)
+        {
+          if (msg == EIB_MUX_OPEN || msg == EIB_MUX_CLOSE)
+            mux_request (buf+2, xlen-2);
+          else
+            handle_message (buf+2, xlen-2);
+          return xlen+2;
+        }
+      auto s = sessions.find (session);
+      if (s == sessions.end())
+        {
+          uint8_t rej[2];
+          EIBSETTYPE (rej, EIB_INVALID_REQUEST);
+          send_frame (session, 2, rej);
+        }
+      else
+        s->second->recv (buf+2, xlen-2);
+      return xlen+2;
+    }
+
+  if (xlen < 2)
+    {
+      sendreject ();
+      return xlen+2;
+    }
+  handle_message (buf, xlen);
+  return xlen+2;
+}
+
+void
+ClientConnection::handle_message (uint8_t *buf, size_t xlen)
+{
   int msg = EIBTYPE (buf);
   if (a_conn)
     {
@@ -151,7 +212,7 @@ ClientConnection::read_cb (uint8_t *buf, size_t len)
         }
       else
         a_conn->recv_Data(buf,xlen);
-      return xlen+2;
+      return;
     }
 
   switch (msg)
@@ -244,6 +305,8 @@ ClientConnection::read_cb (uint8_t *buf, size_t len)
     case EIB_CACHE_READ_NOWAIT:
     case EIB_CACHE_LAST_UPDATES:
     case EIB_CACHE_LAST_UPDATES_2:
+    case EIB_CACHE_LAST_VALUES:
+    case EIB_CACHE_READ_MULTI:
       GroupCacheRequest (SFT, buf,xlen);
       break;
 #endif
@@ -252,6 +315,12 @@ ClientConnection::read_cb (uint8_t *buf, size_t len)
       sendreject (EIB_RESET_CONNECTION);
       break;
 
+    case EIB_MUX_ENABLE:
+    case EIB_MUX_OPEN:
+    case EIB_MUX_CLOSE:
+      mux_request (buf, xlen);
+      break;
+
     default:
       sendreject ();
       break;
@@ -276,8 +345,66 @@ new_a_conn:
         }
       break;
     }
+}
 
-  return xlen+2;
+void
+ClientConnection::mux_request (uint8_t *buf, size_t len)
+{
+  int msg = EIBTYPE (buf);
+  if (msg == EIB_MUX_ENABLE)
+    {
+      if (mux)
+        {
+          sendreject ();
+          return;
+        }
+      // the reply is the last message without a session number
+      sendreject (EIB_MUX_ENABLE);
+      mux = true;
+      TRACEPRINTF (t, 8, "multiplexing enabled");
+      return;
+    }
+  if (!mux || len < 4)
+    {
+      sendreject ();
+      return;
+    }
+
+  uint16_t id = (buf[2] << 8) | buf[3];
+  uint8_t res[4];
+  EIBSETTYPE (res, msg);
+  res[2] = buf[2];
+  res[3] = buf[3];
+  auto s = sessions.find (id);
+  if (msg == EIB_MUX_OPEN)
+    {
+      if (id == 0 || s != sessions.end())
+        {
+          sendreject (EIB_CONNECTION_INUSE);
+          return;
+        }
+      std::shared_ptr<ClientSession> cs = std::make_shared<ClientSession>(this, id);
+      if (!cs->addr)
+        {
+          cs->stop (true);
+          sendreject (EIB_RESET_CONNECTION);
+          return;
+        }
+      TRACEPRINTF (t, 8, "open session %d: %s", id, FormatEIBAddr (cs->addr));
+      sessions[id] = cs;
+    }
+  else
+    {
+      if (s == sessions.end())
+        {
+          sendreject ();
+          return;
+        }
+      TRACEPRINTF (t, 8, "close session %d", id);
+      s->second->stop (false);
+      sessions.erase (s);
+    }
+  sendmessage (4, res);
 }
 
 void
@@ -299,12 +426,77 @@ ClientConnection::sendreject (int type)
 void
 ClientConnection::sendmessage (int size, const uint8_t * msg)
 {
-  uint8_t head[2];
+  t->TracePacket (0, "Send", size, msg);
+  send_frame (0, size, msg);
+}
+
+void
+ClientConnection::send_frame (uint16_t session, int size, const uint8_t * msg)
+{
+  uint8_t rej[2];
   assert (size >= 2);
-  head[0] = (size >> 8) & 0xff;
-  head[1] = (size) & 0xff;
+  if (size > EIB_MAX_MESSAGE)
+    {
+      // a handler built a reply which doesn't fit into a frame
+      ERRORPRINTF (t, E_WARNING | 160, "reply type %04x too long (%d bytes), rejected",
+                   EIBTYPE (msg), size);
+      EIBSETTYPE (rej, EIB_INVALID_REQUEST);
+      msg = rej;
+      size = 2;
+    }
+  // queue header and message as one unit, so that dropping queued
+  // messages can't corrupt the stream
+  unsigned hlen = mux ? 4 : 2;
+  CArray *data = new CArray;
+  data->resize(size+hlen);
+  (*data)[0] = ((size+hlen-2) >> 8) & 0xff;
+  (*data)[1] = (size+hlen-2) & 0xff;
+  if (mux)
+    {
+      (*data)[2] = (session >> 8) & 0xff;
+      (*data)[3] = (session) & 0xff;
+    }
+  memcpy(data->data()+hlen, msg, size);
+  sendbuf.write(data);
+}
 
+ClientSession::ClientSession (ClientConnection *p, uint16_t id)
+  : ClientConnection(p)
+{
+  this->parent = p->shared_from_this();
+  this->id = id;
+  running = true;
+}
+
+ClientSession::~ClientSession ()
+{
+}
+
+void
+ClientSession::stop(bool err)
+{
+  if (addr)
+    {
+      router.release_client_addr(addr);
+      addr = 0;
+    }
+  exit_conn();
+  running = false;
+  parent = nullptr;
+}
+
+void
+ClientSession::sendmessage (int size, const uint8_t * msg)
+{
+  // a late reply, e.g. from the group cache, after the session is gone
+  if (!parent)
+    return;
   t->TracePacket (0, "Send", size, msg);
-  sendbuf.write(head,2);
-  sendbuf.write(msg,size);
+  parent->send_frame (id, size, msg);
+}
+
+void
+ClientSession::mux_request (uint8_t *, size_t)
+{
+  sendreject ();
 }
@@ -26,6 +26,8 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <unordered_map>
+
 #include "common.h"
 #include "eibtypes.h"
 #include "iobuf.h"
@@ -37,7 +39,12 @@
 /** sets the type of a eibd packet*/
 #define EIBSETTYPE(buf,type) do{(buf)[0]=((type)>>8)&0xff;(buf)[1]=(type)&0xff;}while(0)
 
+/** longest message which fits into a frame, even in a multiplexed
+ * connection */
+#define EIB_MAX_MESSAGE 0xfffd
+
 class A__Base;
+class ClientSession;
 
 /** implements a client connection */
 class ClientConnection : public std::enable_shared_from_this<ClientConnection>
@@ -58,29 +65,68 @@ public:
   virtual ~ClientConnection ();
   bool setup();
   void start();
-  void stop(bool err);
+  virtual void stop(bool err);
 
   size_t read_cb(uint8_t *buf, size_t len);
   void error_cb();
 
   /** send a message */
-  void sendmessage (int size, const uint8_t * msg);
+  virtual void sendmessage (int size, const uint8_t * msg);
   /** send a reject */
   void sendreject ();
   /** sends a reject with code @code */
   void sendreject (int code);
 
 protected:
+  /** for sessions, which use their parent's socket */
+  ClientConnection (ClientConnection *parent);
+
   /** sending */
   SendBuf sendbuf;
   RecvBuf recvbuf;
   A__Base *a_conn = nullptr;
 
   void exit_conn();
+  /** process one message */
+  void handle_message (uint8_t *buf, size_t len);
+  /** process EIB_MUX_* */
+  virtual void mux_request (uint8_t *buf, size_t len);
 
 private:
   /** client connection */
   int fd;
+
+  /** set after EIB_MUX_ENABLE: messages carry a session number */
+  bool mux = false;
+  std::unordered_map<uint16_t, std::shared_ptr<ClientSession>> sessions;
+  friend class ClientSession;
+  /** queue a message for this session */
+  void send_frame (uint16_t session, int size, const uint8_t * msg);
+};
+
+/** a session of a multiplexed client connection. It acts like a
+ * connection of its own, with its own address, but shares the
+ * parent's socket. */
+class ClientSession : public ClientConnection
+{
+public:
+  ClientSession (ClientConnection *parent, uint16_t id);
+  virtual ~ClientSession ();
+
+  void stop(bool err) override;
+  void sendmessage (int size, const uint8_t * msg) override;
+  /** process a message from the parent's socket */
+  void recv (uint8_t *buf, size_t len)
+  {
+    handle_message (buf, len);
+  }
+
+protected:
+  void mux_request (uint8_t *buf, size_t len) override;
+
+private:
+  std::shared_ptr<ClientConnection> parent;
+  uint16_t id;
 };
 
 using ClientConnPtr = std::shared_ptr<ClientConnection>;
@@ -23,7 +23,7 @@
 
 LDataPtr CM_TP1_to_L_Data (const CArray & c, TracePtr)
 {
-  LDataPtr l = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> l(new L_Data_PDU ());
   if (c.size() < 6)
     return nullptr;
   if ((c[0] & 0x53) != 0x10)
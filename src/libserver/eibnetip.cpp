@@ -20,13 +20,86 @@
 #include "eibnetip.h"
 #include "config.h"
 
+#include <algorithm>
 #include <cerrno>
+#include <cmath>
 #include <cstring>
 #include <net/if.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/** max number of datagrams per recvmmsg() / sendmmsg() call */
+#define EIBNETIP_BATCH 16
+/** max size of a received datagram */
+#define EIBNETIP_MAXLEN 255
+
+#if !defined(HAVE_RECVMMSG) && !defined(HAVE_SENDMMSG)
+struct mmsghdr
+{
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+#ifndef HAVE_RECVMMSG
+/* fallback: one datagram per call */
+static int
+recvmmsg (int fd, struct mmsghdr *m, unsigned int, int flags, struct timespec *)
+{
+  ssize_t i = recvmsg (fd, &m->msg_hdr, flags);
+  if (i < 0)
+    return -1;
+  m->msg_len = i;
+  return 1;
+}
+#endif
+
+#ifndef HAVE_SENDMMSG
+static int
+sendmmsg (int fd, struct mmsghdr *m, unsigned int, int flags)
+{
+  ssize_t i = sendmsg (fd, &m->msg_hdr, flags);
+  if (i < 0)
+    return -1;
+  m->msg_len = i;
+  return 1;
+}
+#endif
+
+struct EIBNetIPBatch
+{
+  /* receiving */
+  uint8_t buf[EIBNETIP_BATCH][EIBNETIP_MAXLEN];
+  struct sockaddr_in addr[EIBNETIP_BATCH];
+  struct iovec iov[EIBNETIP_BATCH];
+  struct mmsghdr msg[EIBNETIP_BATCH];
+
+  /* sending */
+  CArray out[EIBNETIP_BATCH];
+  struct iovec out_iov[EIBNETIP_BATCH];
+  struct mmsghdr out_msg[EIBNETIP_BATCH];
+
+  EIBNetIPBatch()
+  {
+    memset (msg, 0, sizeof (msg));
+    memset (out_msg, 0, sizeof (out_msg));
+    for (int j = 0; j < EIBNETIP_BATCH; j++)
+      {
+        iov[j].iov_base = buf[j];
+        iov[j].iov_len = EIBNETIP_MAXLEN;
+        msg[j].msg_hdr.msg_iov = &iov[j];
+        msg[j].msg_hdr.msg_iovlen = 1;
+        msg[j].msg_hdr.msg_name = &addr[j];
+
+        out_msg[j].msg_hdr.msg_iov = &out_iov[j];
+        out_msg[j].msg_hdr.msg_iovlen = 1;
+        out_msg[j].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+      }
+  }
+};
+
 EIBNetIPPacket::EIBNetIPPacket ()
 {
   service = 0;
@@ -35,18 +108,24 @@ EIBNetIPPacket::EIBNetIPPacket ()
 
 EIBNetIPPacket *
 EIBNetIPPacket::fromPacket (const CArray & c, const struct sockaddr_in src)
+{
+  return fromPacket (c.data(), c.size(), src);
+}
+
+EIBNetIPPacket *
+EIBNetIPPacket::fromPacket (const uint8_t *c, size_t size, const struct sockaddr_in src)
 {
   EIBNetIPPacket *p;
-  if (c.size() < 6)
+  if (size < 6)
     return 0;
   if (c[0] != 0x6 || c[1] != 0x10)
     return 0;
   unsigned len = (c[4] << 8) | c[5];
-  if (len != c.size())
+  if (len != size)
     return 0;
   p = new EIBNetIPPacket;
   p->service = (c[2] << 8) | c[3];
-  p->data.set (c.data() + 6, len - 6);
+  p->data.set (c + 6, len - 6);
   p->src = src;
   return p;
 }
@@ -69,6 +148,7 @@ const
 
 EIBNetIPSocket::EIBNetIPSocket (struct sockaddr_in bindaddr, bool reuseaddr,
                                 TracePtr tr, SockMode mode)
+  : batch(new EIBNetIPBatch)
 {
   int i;
   t = tr;
@@ -139,6 +219,7 @@ EIBNetIPSocket::~EIBNetIPSocket ()
 {
   TRACEPRINTF (t, 0, "Close D");
   stop(false);
+  *alive = false;
 }
 
 void
@@ -146,6 +227,8 @@ EIBNetIPSocket::stop(bool err)
 {
   if (fd != -1)
     {
+      TRACEPRINTF (t, 0, "received %d datagrams in %d calls, sent %d in %d calls",
+                   n_recv, n_recv_calls, n_send, n_send_calls);
       io_recv.stop();
       io_send.stop();
       if (multicast)
@@ -221,7 +304,7 @@ EIBNetIPSocket::Send (EIBNetIPPacket p, struct sockaddr_in addr)
 
   if (send_q.empty())
     io_send.start(fd, ev::WRITE);
-  send_q.put (std::move(s));
+  send_q.push_back (std::move(s));
 }
 
 void
@@ -233,14 +316,24 @@ EIBNetIPSocket::io_send_cb (ev::io &, int)
       on_next();
       return;
     }
-  const struct _EIBNetIP_Send s = send_q.front ();
-  CArray p = s.data.ToPacket ();
-  t->TracePacket (0, "Send", p);
-  int i = sendto (fd, p.data(), p.size(), 0,
-                  (const struct sockaddr *) &s.addr, sizeof (s.addr));
+  EIBNetIPBatch &b = *batch;
+  int n = 0;
+  for (auto s = send_q.begin(); n < EIBNETIP_BATCH && s != send_q.end(); ++s, ++n)
+    {
+      b.out[n] = s->data.ToPacket ();
+      t->TracePacket (0, "Send", b.out[n]);
+      b.out_iov[n].iov_base = b.out[n].data();
+      b.out_iov[n].iov_len = b.out[n].size();
+      b.out_msg[n].msg_hdr.msg_name = &s->addr;
+    }
+  int i = sendmmsg (fd, b.out_msg, n, 0);
   if (i > 0)
     {
-      send_q.get ();
+      n_send_calls++;
+      n_send += i;
+      if (i > 1)
+        TRACEPRINTF (t, 0, "Sent %d datagrams in one call", i);
+      send_q.erase (send_q.begin(), send_q.begin() + i);
       send_error = 0;
     }
   else
@@ -250,8 +343,8 @@ EIBNetIPSocket::io_send_cb (ev::io &, int)
           TRACEPRINTF (t, 0, "Send: %s", strerror(errno));
           if (send_error++ > 5)
             {
-              t->TracePacket (0, "EIBnetSocket:drop", p);
-              send_q.get ();
+              t->TracePacket (0, "EIBnetSocket:drop", b.out[0]);
+              send_q.pop_front ();
               send_error = 0;
               on_error();
             }
@@ -262,24 +355,41 @@ EIBNetIPSocket::io_send_cb (ev::io &, int)
 void
 EIBNetIPSocket::io_recv_cb (ev::io &, int)
 {
-  uint8_t buf[255];
-  socklen_t rl;
-  sockaddr_in r;
-  rl = sizeof (r);
-  memset (&r, 0, sizeof (r));
+  EIBNetIPBatch &b = *batch;
+  for (int j = 0; j < EIBNETIP_BATCH; j++)
+    {
+      memset (&b.addr[j], 0, sizeof (b.addr[j]));
+      b.msg[j].msg_hdr.msg_namelen = sizeof (b.addr[j]);
+    }
 
-  int i = recvfrom (fd, buf, sizeof (buf), 0, (struct sockaddr *) &r, &rl);
-  if (i < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
-    on_error();
-  else if (i >= 0 && rl == sizeof (r))
+  int n = recvmmsg (fd, b.msg, EIBNETIP_BATCH, 0, nullptr);
+  if (n < 0)
     {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        on_error();
+      return;
+    }
+  n_recv_calls++;
+  n_recv += n;
+  if (n > 1)
+    TRACEPRINTF (t, 0, "Received %d datagrams in one call", n);
+
+  // on_recv() may stop or even delete us; our reference keeps the
+  // flag readable after the destructor has cleared it
+  std::shared_ptr<bool> still_alive = alive;
+  for (int j = 0; j < n && *still_alive && fd != -1; j++)
+    {
+      const uint8_t *buf = b.buf[j];
+      int i = b.msg[j].msg_len;
+      const sockaddr_in &r = b.addr[j];
+      if (b.msg[j].msg_hdr.msg_namelen != sizeof (r))
+        continue;
       if (recvall == 1 || !memcmp (&r, &recvaddr, sizeof (r)) ||
           (recvall == 2 && memcmp (&r, &localaddr, sizeof (r))) ||
           (recvall == 3 && !memcmp (&r, &recvaddr2, sizeof (r))))
         {
           t->TracePacket (0, "Recv", i, buf);
-          EIBNetIPPacket *p =
-            EIBNetIPPacket::fromPacket (CArray (buf, i), r);
+          EIBNetIPPacket *p = EIBNetIPPacket::fromPacket (buf, i, r);
           if (p)
             on_recv(p);
           else
@@ -840,12 +950,233 @@ parseEIBnet_RoutingIndication (const EIBNetIPPacket & p, EIBnet_RoutingIndicatio
 
 EIBNetIPPacket EIBnet_RoutingLostMessage::ToPacket () const
 {
-  // @todo
-  abort();
+  EIBNetIPPacket p;
+  p.service = ROUTING_LOST_MESSAGE;
+  p.data.resize (4);
+  p.data[0] = 4;
+  p.data[1] = devicestate;
+  p.data[2] = (count >> 8) & 0xff;
+  p.data[3] = count & 0xff;
+  return p;
 }
 
 int
 parseEIBnet_RoutingLostMessage (const EIBNetIPPacket & p, EIBnet_RoutingLostMessage & r)
 {
+  if (p.service != ROUTING_LOST_MESSAGE)
+    return 1;
+  if (p.data.size() != 4)
+    return 1;
+  if (p.data[0] != 4)
+    return 1;
+  r.devicestate = p.data[1];
+  r.count = (p.data[2] << 8) | p.data[3];
   return 0;
 }
+
+EIBNetIPPacket EIBnet_RoutingBusy::ToPacket () const
+{
+  EIBNetIPPacket p;
+  p.service = ROUTING_BUSY;
+  p.data.resize (6);
+  p.data[0] = 6;
+  p.data[1] = devicestate;
+  p.data[2] = (waittime >> 8) & 0xff;
+  p.data[3] = waittime & 0xff;
+  p.data[4] = (control >> 8) & 0xff;
+  p.data[5] = control & 0xff;
+  return p;
+}
+
+int
+parseEIBnet_RoutingBusy (const EIBNetIPPacket & p, EIBnet_RoutingBusy & r)
+{
+  if (p.service != ROUTING_BUSY)
+    return 1;
+  if (p.data.size() != 6)
+    return 1;
+  if (p.data[0] != 6)
+    return 1;
+  r.devicestate = p.data[1];
+  r.waittime = (p.data[2] << 8) | p.data[3];
+  r.control = (p.data[4] << 8) | p.data[5];
+  return 0;
+}
+
+void
+EIBnetRTO::setup (IniSectionPtr& s)
+{
+  min_rto = s->value("min-timeout", TUNNELING_REQUEST_TIMEOUT);
+  if (min_rto > TUNNELING_REQUEST_TIMEOUT)
+    min_rto = TUNNELING_REQUEST_TIMEOUT;
+}
+
+void
+EIBnetRTO::sample (ev_tstamp rtt)
+{
+  if (!valid)
+    {
+      smoothed = rtt;
+      rttvar = rtt / 2;
+      valid = true;
+    }
+  else
+    {
+      rttvar = 0.75 * rttvar + 0.25 * fabs (smoothed - rtt);
+      smoothed = 0.875 * smoothed + 0.125 * rtt;
+    }
+  rto = std::min (std::max (smoothed + 4 * rttvar, min_rto),
+                  TUNNELING_REQUEST_TIMEOUT);
+}
+
+void
+EIBnetRTO::backoff ()
+{
+  rto = std::min (rto * 2, TUNNELING_REQUEST_TIMEOUT);
+}
+
+EIBnetRoutingFlow::EIBnetRoutingFlow (TracePtr tr)
+{
+  t = tr;
+  timer.set<EIBnetRoutingFlow,&EIBnetRoutingFlow::timer_cb>(this);
+  rng.seed ((unsigned)(ev_time () * 1000000) ^ getpid ());
+}
+
+EIBnetRoutingFlow::~EIBnetRoutingFlow ()
+{
+  stop ();
+  if (n_busy_recv || n_busy_sent || n_lost || n_held)
+    TRACEPRINTF (t, 2, "Routing: sent %d (%d delayed), BUSY recv %d sent %d, lost %d",
+                 n_sent, n_held, n_busy_recv, n_busy_sent, n_lost);
+}
+
+void
+EIBnetRoutingFlow::setup (IniSectionPtr& s)
+{
+  unsigned rate = s->value("rate-limit", 50);
+  interval = rate ? 1.0 / rate : 0;
+  busy_threshold = s->value("busy-threshold", 50);
+  busy_wait = s->value("busy-wait", 100);
+}
+
+void
+EIBnetRoutingFlow::stop ()
+{
+  timer.stop ();
+  held.clear ();
+  sock = nullptr;
+}
+
+bool
+EIBnetRoutingFlow::Send (EIBNetIPSocket *s, EIBNetIPPacket p, struct sockaddr_in addr)
+{
+  ev_tstamp now = ev_now (EV_DEFAULT);
+  ev_tstamp when = std::max (next_send, pause_until);
+
+  if (held.empty () && when <= now)
+    {
+      s->Send (p, addr);
+      sent (now);
+      return true;
+    }
+
+  n_held++;
+  sock = s;
+  held.push_back ({p, addr});
+  if (held.size () == 1)
+    timer.start (std::max (when - now, 0.0), 0);
+  return false;
+}
+
+void
+EIBnetRoutingFlow::sent (ev_tstamp now)
+{
+  n_sent++;
+  next_send = now + interval;
+}
+
+void
+EIBnetRoutingFlow::timer_cb (ev::timer &, int)
+{
+  if (held.empty ())
+    return;
+
+  ev_tstamp now = ev_now (EV_DEFAULT);
+  ev_tstamp when = std::max (next_send, pause_until);
+  if (when > now)
+    {
+      // a BUSY arrived while we were waiting
+      timer.start (when - now, 0);
+      return;
+    }
+
+  sock->Send (held.front ().data, held.front ().addr);
+  held.pop_front ();
+  sent (now);
+  if (!held.empty ())
+    timer.start (interval, 0);
+  else
+    on_next ();
+}
+
+/** After N*100 msec without BUSY, N is decremented every 5 msec. */
+void
+EIBnetRoutingFlow::decay (ev_tstamp now)
+{
+  if (!busy_count || now < decay_start)
+    return;
+  unsigned steps = (now - decay_start) / 0.005;
+  busy_count = steps >= busy_base ? 0 : busy_base - steps;
+}
+
+void
+EIBnetRoutingFlow::busy (const EIBnet_RoutingBusy &r)
+{
+  n_busy_recv++;
+  if (r.control)
+    return; // not for routers
+
+  ev_tstamp now = ev_now (EV_DEFAULT);
+  decay (now);
+  // several BUSY messages within 10 msec count as one
+  if (last_busy < 0 || now - last_busy > 0.010)
+    busy_count++;
+  last_busy = now;
+  busy_base = busy_count;
+  decay_start = now + busy_count * 0.100;
+
+  std::uniform_real_distribution<ev_tstamp> random (0, busy_count * 0.050);
+  ev_tstamp until = now + r.waittime / 1000.0 + random (rng);
+  if (until > pause_until)
+    pause_until = until;
+  TRACEPRINTF (t, 2, "Routing BUSY: wait %d ms, N=%d, pause %.3f s",
+               r.waittime, busy_count, pause_until - now);
+
+  if (!held.empty ())
+    timer.start (pause_until - now, 0);
+}
+
+void
+EIBnetRoutingFlow::lost (const EIBnet_RoutingLostMessage &r)
+{
+  n_lost += r.count;
+  TRACEPRINTF (t, 2, "Routing LOST_MESSAGE: %d lost (state %02x), %d total",
+               r.count, r.devicestate, n_lost);
+}
+
+void
+EIBnetRoutingFlow::check_busy (EIBNetIPSocket *s, struct sockaddr_in addr, size_t queued)
+{
+  if (!busy_threshold || queued < busy_threshold)
+    return;
+  ev_tstamp now = ev_now (EV_DEFAULT);
+  if (now < busy_sent_until)
+    return;
+  busy_sent_until = now + busy_wait / 1000.0;
+
+  EIBnet_RoutingBusy r;
+  r.waittime = busy_wait;
+  n_busy_sent++;
+  TRACEPRINTF (t, 2, "Routing: %d queued, sending BUSY", queued);
+  s->Send (r.ToPacket (), addr);
+}
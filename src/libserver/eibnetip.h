@@ -27,12 +27,16 @@
 #ifndef EIBNETIP_H
 #define EIBNETIP_H
 
+#include <deque>
+#include <memory>
+#include <random>
 #include <ev++.h>
 #include <netinet/in.h>
 
 #include "apdu.h"
 #include "cm_ip.h"
 #include "common.h"
+#include "inifile.h"
 #include "iobuf.h" // for nonblocking
 #include "ipsupport.h"
 #include "lpdu.h"
@@ -165,6 +169,8 @@ public:
   /** create from character array */
   static EIBNetIPPacket *fromPacket (const CArray & c,
                                      const struct sockaddr_in src);
+  static EIBNetIPPacket *fromPacket (const uint8_t *c, size_t len,
+                                     const struct sockaddr_in src);
   /** convert to character array */
   CArray ToPacket () const;
 };
@@ -373,11 +379,30 @@ int parseEIBnet_RoutingIndication (const EIBNetIPPacket & p, EIBnet_RoutingIndic
 
 class EIBnet_RoutingLostMessage
 {
+public:
+  EIBnet_RoutingLostMessage () = default;
+  uint8_t devicestate = 0;
+  uint16_t count = 0;
   EIBNetIPPacket ToPacket () const;
 };
 
 int parseEIBnet_RoutingLostMessage (const EIBNetIPPacket & p, EIBnet_RoutingLostMessage & r);
 
+/** 03_08_05 2.3.5 */
+class EIBnet_RoutingBusy
+{
+public:
+  EIBnet_RoutingBusy () = default;
+  uint8_t devicestate = 0;
+  /** in msec */
+  uint16_t waittime = 0;
+  /** zero: addressed to all routing devices */
+  uint16_t control = 0;
+  EIBNetIPPacket ToPacket () const;
+};
+
+int parseEIBnet_RoutingBusy (const EIBNetIPPacket & p, EIBnet_RoutingBusy & r);
+
 typedef void (*eibpacket_cb_t)(void *data, EIBNetIPPacket *p);
 
 class EIBPacketCallback
@@ -434,6 +459,9 @@ struct _EIBNetIP_Send
   struct sockaddr_in addr;
 };
 
+/** buffers for batched socket I/O, see eibnetip.cpp */
+struct EIBNetIPBatch;
+
 /** EIBnet/IP socket */
 class EIBNetIPSocket
 {
@@ -503,8 +531,18 @@ private:
   void next_cb() { }
 
   /** output queue */
-  Queue < struct _EIBNetIP_Send > send_q;
-  void send_q_drop();
+  std::deque < struct _EIBNetIP_Send > send_q;
+
+  /** buffers for recvmmsg() and sendmmsg(), reused for every call */
+  std::unique_ptr<EIBNetIPBatch> batch;
+  /** cleared by the destructor. io_recv_cb holds a reference, so that
+   * it notices when a receive callback deleted us */
+  std::shared_ptr<bool> alive = std::make_shared<bool>(true);
+  /** statistics */
+  unsigned long n_recv = 0;
+  unsigned long n_recv_calls = 0;
+  unsigned long n_send = 0;
+  unsigned long n_send_calls = 0;
 
   /** multicast address */
   struct ip_mreq maddr;
@@ -514,6 +552,102 @@ private:
   bool multicast;
 };
 
+/** Retransmit timeout for tunnel requests.
+ *
+ * Estimated from the ACK round-trip time like TCP does (RFC 6298), but
+ * never longer than TUNNELING_REQUEST_TIMEOUT, which is also the initial
+ * value. Frames which have been retransmitted must not be sampled.
+ */
+class EIBnetRTO
+{
+public:
+  /** reads "min-timeout" */
+  void setup (IniSectionPtr& s);
+  void sample (ev_tstamp rtt);
+  /** a timeout happened: double the current value */
+  void backoff ();
+  ev_tstamp timeout () const
+  {
+    return rto;
+  }
+  ev_tstamp srtt () const
+  {
+    return valid ? smoothed : 0;
+  }
+
+private:
+  bool valid = false;
+  ev_tstamp smoothed = 0;
+  ev_tstamp rttvar = 0;
+  ev_tstamp rto = TUNNELING_REQUEST_TIMEOUT;
+  ev_tstamp min_rto = TUNNELING_REQUEST_TIMEOUT;
+};
+
+/** Routing flow control, 03_08_05 2.3.
+ *
+ * Spaces outgoing ROUTING_INDICATIONs to a configurable rate and backs off
+ * when some other router sends ROUTING_BUSY. Packets which may not be sent
+ * yet are held; on_next fires when the last of them has gone out.
+ */
+class EIBnetRoutingFlow
+{
+public:
+  InfoCallback on_next;
+
+  EIBnetRoutingFlow (TracePtr tr);
+  ~EIBnetRoutingFlow ();
+  void setup (IniSectionPtr& s);
+  /** drop held packets */
+  void stop ();
+
+  /** Send a packet, or hold it until we may. Returns false if it was held. */
+  bool Send (EIBNetIPSocket *sock, EIBNetIPPacket p, struct sockaddr_in addr);
+
+  /** process a ROUTING_BUSY / ROUTING_LOST_MESSAGE packet */
+  void busy (const EIBnet_RoutingBusy &r);
+  void lost (const EIBnet_RoutingLostMessage &r);
+
+  /** Tell others to back off if our queue has @queued entries,
+   * at most once per wait time. */
+  void check_busy (EIBNetIPSocket *sock, struct sockaddr_in addr, size_t queued);
+
+  /** statistics */
+  unsigned long n_sent = 0;
+  unsigned long n_held = 0;
+  unsigned long n_busy_recv = 0;
+  unsigned long n_busy_sent = 0;
+  unsigned long n_lost = 0;
+
+private:
+  TracePtr t;
+  ev::timer timer;
+  void timer_cb (ev::timer &w, int revents);
+  void decay (ev_tstamp now);
+  void sent (ev_tstamp now);
+
+  /** held packets and the socket to send them on */
+  EIBNetIPSocket *sock = nullptr;
+  std::deque < struct _EIBNetIP_Send > held;
+
+  /** 1/rate-limit, in sec */
+  ev_tstamp interval = 0;
+  ev_tstamp next_send = 0;
+  /** don't send anything before this, due to ROUTING_BUSY */
+  ev_tstamp pause_until = 0;
+
+  /** BUSY count (N in the spec) and its decay state */
+  unsigned busy_count = 0;
+  unsigned busy_base = 0;
+  ev_tstamp last_busy = -1;
+  ev_tstamp decay_start = 0;
+  std::minstd_rand rng;
+
+  /** sending our own ROUTING_BUSY */
+  size_t busy_threshold = 0;
+  uint16_t busy_wait = 0;
+  ev_tstamp busy_sent_until = 0;
+};
+
 #endif
 
 /** @} */
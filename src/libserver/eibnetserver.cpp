@@ -54,12 +54,13 @@ EIBnetServer::EIBnetServer (BaseRouter& r, IniSectionPtr& s)
 
 EIBnetDriver::EIBnetDriver (LinkConnectClientPtr c,
                             std::string& multicastaddr, int port, std::string& intf)
-  : SubDriver(c)
+  : SubDriver(c), flow(t)
 {
   struct sockaddr_in baddr;
   struct ip_mreq mcfg;
   sock = 0;
   t->setAuxName("driver");
+  flow.on_next.set<EIBnetDriver,&EIBnetDriver::flow_next_cb>(this);
 
   TRACEPRINTF (t, 8, "OpenD");
 
@@ -119,12 +120,11 @@ err_out:
 bool
 EIBnetDriver::setup()
 {
-  if (!assureFilter("pace"))
-    return false;
   if (!SubDriver::setup())
     return false;
   if (! sock)
     return false;
+  flow.setup(cfg);
 
   return true;
 }
@@ -169,12 +169,27 @@ EIBnetServer::setup()
       /* set up a temporary fake tunnel stack to test the arguments early. */
       if (!static_cast<Router &>(router).checkStack(tunnel_cfg))
         return false;
+      /* ConnState reads these when a client connects. */
+      QueuePolicy policy;
+      tunnel_cfg->value("queue-size", 64*1024);
+      tunnel_cfg->value("queue-messages", 0);
+      if (!parseQueuePolicy(tunnel_cfg->value("queue-policy", "disconnect"), policy))
+        {
+          ERRORPRINTF (t, E_ERROR | 151, "%s: queue-policy must be one of disconnect, drop-oldest, drop-newest", tunnel_cfg->name);
+          return false;
+        }
+      tunnel_cfg->value("window", 1);
+      EIBnetRTO rto;
+      rto.setup(tunnel_cfg);
     }
 
   if (route)
     {
       if (!static_cast<Router &>(router).checkStack(router_cfg))
         return false;
+      /* EIBnetDriver reads these when the server starts. */
+      EIBnetRoutingFlow flow(t);
+      flow.setup(router_cfg);
     }
 
   return true;
@@ -259,16 +274,23 @@ void
 EIBnetDriver::send_L_Data (LDataPtr l)
 {
   EIBnetServer &parent = *std::static_pointer_cast<EIBnetServer>(server);
-  if (parent.route)
+  if (parent.route && parent.sock)
     {
       EIBNetIPPacket p;
       p.service = ROUTING_INDICATION;
       p.data = L_Data_ToCEMI (0x29, l);
-      parent.Send (p);
+      if (!flow.Send (parent.sock, p, maddr))
+        return;
     }
   send_Next();
 }
 
+void
+EIBnetDriver::flow_next_cb ()
+{
+  send_Next();
+}
+
 bool ConnState::setup()
 {
   // Force queuing so that a bad or unreachable client can't disable the whole system
@@ -276,6 +298,17 @@ bool ConnState::setup()
     return false;
   if (! SubDriver::setup())
     return false;
+  max_out_bytes = cfg->value("queue-size", 64*1024);
+  max_out_msgs = cfg->value("queue-messages", 0);
+  if (!parseQueuePolicy(cfg->value("queue-policy", "disconnect"), out_policy))
+    {
+      ERRORPRINTF (t, E_ERROR | 151, "%s: queue-policy must be one of disconnect, drop-oldest, drop-newest", cfg->name);
+      return false;
+    }
+  window = cfg->value("window", 1);
+  if (window < 1 || window > 32 || type == CT_CONFIG)
+    window = 1;
+  rto.setup(cfg);
   if (type == CT_BUSMONITOR && ! dynamic_cast<Router *>(&server->router)->registerVBusmonitor(this))
     return false;
 
@@ -284,12 +317,11 @@ bool ConnState::setup()
   return true;
 }
 
-void ConnState::send_L_Busmonitor (LBusmonPtr l)
+void ConnState::send_L_Busmonitor (const L_Busmon_PDU & l)
 {
   if (type == CT_BUSMONITOR)
     {
-      out.put (Busmonitor_to_CEMI (0x2B, l, no++));
-      if (! retries)
+      if (put_out (Busmonitor_to_CEMI (0x2B, l, no++), true))
         send_trigger.send();
     }
 }
@@ -299,26 +331,40 @@ void ConnState::send_L_Data (LDataPtr l)
   if (type == CT_STANDARD)
     {
       assert (!do_send_next);
-      do_send_next = true;
-      out.put (L_Data_ToCEMI (0x29, l));
-      if (! retries)
-        send_trigger.send();
+      put_out (L_Data_ToCEMI (0x29, l), false);
+      send_trigger.send();
+      if (out.size() < window)
+        send_Next();
+      else
+        do_send_next = true;
     }
 }
 
+uint8_t
+EIBnetServer::alloc_channel ()
+{
+  for (unsigned w = 0; w < 4; w++)
+    if (~channels_used[w])
+      {
+        unsigned bit = __builtin_ctzll (~channels_used[w]);
+        channels_used[w] |= 1ULL << bit;
+        return w * 64 + bit;
+      }
+  return 0;
+}
+
+void
+EIBnetServer::free_channel (uint8_t id)
+{
+  channels_used[id / 64] &= ~(1ULL << (id % 64));
+}
+
 int
 EIBnetServer::addClient (ConnType type, const EIBnet_ConnectRequest & r1,
                          eibaddr_t addr)
 {
-  int id = 1;
-rt:
-  ITER(i, connections)
-  if ((*i)->channel == id)
-    {
-      id++;
-      goto rt;
-    }
-  if (id <= 0xff)
+  int id = alloc_channel ();
+  if (id)
     {
       LinkConnectClientPtr conn = LinkConnectClientPtr(new LinkConnectClient(std::dynamic_pointer_cast<EIBnetServer>(shared_from_this()), tunnel_cfg, t));
       ConnStatePtr s = ConnStatePtr(new ConnState(conn, addr));
@@ -332,13 +378,14 @@ rt:
       s->no = 1;
       s->type = type;
       s->nat = r1.nat;
-      if(!conn->setup())
-        return -1;
-      if(!static_cast<Router &>(router).registerLink(conn, true))
-        return -1;
-      connections.push_back(s);
+      if(!conn->setup() || !static_cast<Router &>(router).registerLink(conn, true))
+        {
+          free_channel (id);
+          return -1;
+        }
+      connections[id] = s;
     }
-  return id;
+  return id ? id : -1;
 }
 
 ConnState::ConnState (LinkConnectClientPtr c, eibaddr_t addr)
@@ -356,40 +403,167 @@ ConnState::ConnState (LinkConnectClientPtr c, eibaddr_t addr)
 
 void ConnState::sendtimeout_cb(ev::timer &, int)
 {
-  if (++retries <= 2)
+  if (retries++ < 1)
     {
-      send_trigger.send();
+      TRACEPRINTF (t, 8, "ACK timeout for %d, resending %d", sno, inflight);
+      rto.backoff ();
+      retransmit ();
       return;
     }
-  CArray p = out.get ();
+  CArray p = get_out ();
   t->TracePacket (2, "dropped no-ACK", p.size(), p.data());
   stop(true);
 }
 
+bool ConnState::put_out(CArray &&p, bool limit)
+{
+  auto full = [this](size_t len)
+  {
+    return (max_out_msgs && out.size() >= max_out_msgs) ||
+           (max_out_bytes && out_bytes + len > max_out_bytes);
+  };
+
+  if (out_overflow)
+    {
+      n_dropped++;
+      return false;
+    }
+  if (limit && full(p.size()))
+    switch (out_policy)
+      {
+      case QP_DISCONNECT:
+        // stop() from within the router's callback is not safe
+        out_overflow = true;
+        n_dropped++;
+        send_trigger.send();
+        return false;
+      case QP_DROP_NEWEST:
+        n_dropped++;
+        return false;
+      case QP_DROP_OLDEST:
+        {
+          // the head of the queue may be waiting for its ACK
+          size_t keep = inflight;
+          while (out.size() > keep && full(p.size()))
+            {
+              out_bytes -= out[keep].size();
+              out.erase(out.begin() + keep);
+              n_dropped++;
+            }
+        }
+        break;
+      }
+  out_bytes += p.size();
+  if (max_queued < out_bytes)
+    max_queued = out_bytes;
+  out.push_back(std::move(p));
+  return true;
+}
+
+CArray ConnState::get_out()
+{
+  CArray p = std::move(out.front());
+  out.pop_front();
+  out_bytes -= p.size();
+  return p;
+}
+
 void ConnState::send_trigger_cb(ev::async &, int)
 {
-  if (out.empty ())
-    return;
-  EIBNetIPPacket p;
-  if (type == CT_CONFIG)
+  if (out_overflow)
     {
-      EIBnet_ConfigRequest r;
-      r.channel = channel;
-      r.seqno = sno;
-      r.CEMI = out.front ();
-      p = r.ToPacket ();
+      ERRORPRINTF (t, E_WARNING | 152, "send queue full (%d messages, %d bytes), disconnecting",
+                   out.size(), out_bytes);
+      stop(true);
+      return;
     }
-  else
+  ev_tstamp now = ev_now (EV_DEFAULT);
+  while (inflight < window && inflight < out.size ())
     {
-      EIBnet_TunnelRequest r;
-      r.channel = channel;
-      r.seqno = sno;
-      r.CEMI = out.front ();
-      p = r.ToPacket ();
+      EIBNetIPPacket p;
+      if (type == CT_CONFIG)
+        {
+          EIBnet_ConfigRequest r;
+          r.channel = channel;
+          r.seqno = sno + inflight;
+          r.CEMI = out[inflight];
+          p = r.ToPacket ();
+        }
+      else
+        {
+          EIBnet_TunnelRequest r;
+          r.channel = channel;
+          r.seqno = sno + inflight;
+          r.CEMI = out[inflight];
+          p = r.ToPacket ();
+        }
+      // Karn: don't measure the RTT of retransmitted frames
+      sent_at.push_back (inflight < resent ? 0 : now);
+      inflight++;
+      std::static_pointer_cast<EIBnetServer>(server)->mcast->Send (p, daddr);
+    }
+  if (inflight && !sendtimeout.is_active ())
+    sendtimeout.start(rto.timeout (), 0);
+}
+
+void ConnState::retransmit()
+{
+  n_resent += inflight;
+  resent = inflight;
+  inflight = 0;
+  sent_at.clear ();
+  sendtimeout.stop ();
+  send_trigger.send ();
+}
+
+bool ConnState::ack(uint8_t seqno)
+{
+  // With a window, an ACK covers all earlier frames: the peer
+  // doesn't accept frames out of order.
+  unsigned n = (uint8_t)(seqno - sno) + 1;
+  if (n > inflight)
+    {
+      if (window > 1 && inflight && seqno == (uint8_t)(sno - 1) && !fast_resent)
+        {
+          // the peer got a duplicate and is still waiting for sno
+          TRACEPRINTF (t, 8, "Duplicate ACK for %d, resending %d", seqno, inflight);
+          fast_resent = true;
+          retransmit ();
+        }
+      else if (!inflight)
+        TRACEPRINTF (t, 8, "Unexpected ACK %d", seqno);
+      else
+        TRACEPRINTF (t, 8, "Wrong sequence %d<->%d", seqno, sno);
+      return false;
+    }
+
+  if (sent_at[n - 1])
+    rto.sample (ev_now (EV_DEFAULT) - sent_at[n - 1]);
+  while (n--)
+    {
+      get_out ();
+      sent_at.pop_front ();
+      inflight--;
+      sno++;
+      n_sent++;
+      if (resent)
+        resent--;
     }
-  retries ++;
-  sendtimeout.start(TUNNELING_REQUEST_TIMEOUT,0);
-  std::static_pointer_cast<EIBnetServer>(server)->mcast->Send (p, daddr);
+  retries = 0;
+  fast_resent = false;
+  sendtimeout.stop ();
+  if (inflight)
+    sendtimeout.start (rto.timeout (), 0);
+  reset_timer(); // presumably the client is alive if it can ack
+
+  if (out.size () > inflight)
+    send_trigger.send ();
+  if (do_send_next && out.size () < window)
+    {
+      do_send_next = false;
+      send_Next();
+    }
+  return true;
 }
 
 void ConnState::timeout_cb(ev::timer &, int)
@@ -410,13 +584,16 @@ void ConnState::timeout_cb(ev::timer &, int)
 
 void ConnState::stop(bool err)
 {
-  TRACEPRINTF (t, 8, "Stop Conn %d", channel);
+  TRACEPRINTF (t, 8, "Stop Conn %d: sent %d, resent %d, dropped %d, max queued %d bytes, RTT %.1f ms",
+               channel, n_sent, n_resent, n_dropped, max_queued, rto.srtt () * 1000);
   if (type == CT_BUSMONITOR)
     dynamic_cast<Router *>(&server->router)->deregisterVBusmonitor(this);
   timeout.stop();
   sendtimeout.stop();
   send_trigger.stop();
   retries = 0;
+  inflight = 0;
+  sent_at.clear();
   std::static_pointer_cast<EIBnetServer>(server)->drop_connection (std::static_pointer_cast<ConnState>(shared_from_this()));
   if (addr)
     {
@@ -437,15 +614,13 @@ void EIBnetServer::drop_trigger_cb(ev::async &, int)
   while (!drop_q.empty())
     {
       ConnStatePtr s = drop_q.get();
-      ITER(i,connections)
-      if (*i == s)
-        {
-          connections.erase (i);
-          auto c = std::dynamic_pointer_cast<LinkConnect>(s->conn.lock());
-          if (c != nullptr)
-            static_cast<Router &>(router).unregisterLink(c);
-          break;
-        }
+      if (connections[s->channel] != s)
+        continue;
+      connections[s->channel].reset();
+      free_channel (s->channel);
+      auto c = std::dynamic_pointer_cast<LinkConnect>(s->conn.lock());
+      if (c != nullptr)
+        static_cast<Router &>(router).unregisterLink(c);
     }
 }
 
@@ -632,7 +807,30 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
       if (!c)
         t->TracePacket (2, "unCEMIable ROUTING_INDICATION", p1->data);
       else if (route)
-        mcast->recv_L_Data (std::move(c));
+        {
+          mcast->recv_L_Data (std::move(c));
+          if (sock)
+            mcast->flow.check_busy (sock, mcast->maddr,
+                                    static_cast<Router &>(router).queue_length());
+        }
+      goto out;
+    }
+  if (p1->service == ROUTING_BUSY)
+    {
+      EIBnet_RoutingBusy r1;
+      if (parseEIBnet_RoutingBusy (*p1, r1))
+        t->TracePacket (2, "unparseable ROUTING_BUSY", p1->data);
+      else if (route)
+        mcast->flow.busy (r1);
+      goto out;
+    }
+  if (p1->service == ROUTING_LOST_MESSAGE)
+    {
+      EIBnet_RoutingLostMessage r1;
+      if (parseEIBnet_RoutingLostMessage (*p1, r1))
+        t->TracePacket (2, "unparseable ROUTING_LOST_MESSAGE", p1->data);
+      else if (route)
+        mcast->flow.lost (r1);
       goto out;
     }
   if (p1->service == CONNECTIONSTATE_REQUEST)
@@ -646,13 +844,12 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
         }
       r2.channel = r1.channel;
       r2.status = E_CONNECTION_ID;
-      ITER(i, connections)
-      if ((*i)->channel == r1.channel)
+      ConnStatePtr &c = connections[r1.channel];
+      if (c)
         {
-          TRACEPRINTF ((*i)->t, 8, "CONNECTIONSTATE_REQUEST on %d", r1.channel);
+          TRACEPRINTF (c->t, 8, "CONNECTIONSTATE_REQUEST on %d", r1.channel);
           r2.status = 0;
-          (*i)->reset_timer();
-          break;
+          c->reset_timer();
         }
       if (r2.status)
         TRACEPRINTF (t, 2, "Unknown connection %d", r2.channel);
@@ -671,13 +868,12 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
         }
       r2.status = E_CONNECTION_ID;
       r2.channel = r1.channel;
-      ITER(i,connections)
-      if ((*i)->channel == r1.channel)
+      ConnStatePtr c = connections[r1.channel];
+      if (c)
         {
           r2.status = 0;
-          TRACEPRINTF ((*i)->t, 8, "DISCONNECT_REQUEST");
-          (*i)->stop(false);
-          break;
+          TRACEPRINTF (c->t, 8, "DISCONNECT_REQUEST");
+          c->stop(false);
         }
       if (r2.status)
         TRACEPRINTF (t, 8, "DISCONNECT_REQUEST on %d", r1.channel);
@@ -713,11 +909,16 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
           else if (r1.CRI[1] == 0x02 || r1.CRI[1] == 0x80)
             {
               int id = addClient ((r1.CRI[1] == 0x80) ? CT_BUSMONITOR : CT_STANDARD, r1, a);
-              if (id <= 0xff)
+              if (id > 0)
                 {
                   r2.channel = id;
                   r2.status = E_NO_ERROR;
                 }
+              else
+                {
+                  static_cast<Router &>(router).release_client_addr (a);
+                  r2.status = E_NO_MORE_CONNECTIONS;
+                }
             }
           else
             {
@@ -731,11 +932,13 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
           r2.CRD[0] = 0x03;
           TRACEPRINTF (t, 8, "Tunnel CONNECTION_REQ, no addr (mgmt)");
           int id = addClient (CT_CONFIG, r1, 0);
-          if (id <= 0xff)
+          if (id > 0)
             {
               r2.channel = id;
               r2.status = E_NO_ERROR;
             }
+          else
+            r2.status = E_NO_MORE_CONNECTIONS;
         }
       else
         {
@@ -765,13 +968,11 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
           t->TracePacket (2, "unparseable TUNNEL_REQUEST", p1->data);
           goto out;
         }
-      if (tunnel)
-        ITER(i,connections)
-        if ((*i)->channel == r1.channel)
-          {
-            (*i)->tunnel_request(r1, isock);
-            goto out;
-          }
+      if (tunnel && connections[r1.channel])
+        {
+          connections[r1.channel]->tunnel_request(r1, isock);
+          goto out;
+        }
       TRACEPRINTF (t, 8, "TUNNEL_REQ on unknown %d", r1.channel);
       goto out;
     }
@@ -783,13 +984,11 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
           t->TracePacket (2, "unparseable TUNNEL_RESPONSE", p1->data);
           goto out;
         }
-      if (tunnel)
-        ITER(i, connections)
-        if ((*i)->channel == r1.channel)
-          {
-            (*i)->tunnel_response (r1);
-            goto out;
-          }
+      if (tunnel && connections[r1.channel])
+        {
+          connections[r1.channel]->tunnel_response (r1);
+          goto out;
+        }
       TRACEPRINTF (t, 8, "TUNNEL_ACK on unknown %d",r1.channel);
       goto out;
     }
@@ -803,12 +1002,8 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
           goto out;
         }
       TRACEPRINTF (t, 8, "CONFIG_REQ on %d",r1.channel);
-      ITER(i, connections)
-      if ((*i)->channel == r1.channel)
-        {
-          (*i)->config_request (r1, isock);
-          break;
-        }
+      if (connections[r1.channel])
+        connections[r1.channel]->config_request (r1, isock);
       goto out;
     }
   if (p1->service == DEVICE_CONFIGURATION_ACK)
@@ -819,10 +1014,9 @@ EIBnetServer::handle_packet (EIBNetIPPacket *p1, EIBNetIPSocket *isock)
           t->TracePacket (2, "unparseable DEVICE_CONFIGURATION_ACK", p1->data);
           goto out;
         }
-      ITER(i, connections)
-      if ((*i)->channel == r1.channel)
+      if (connections[r1.channel])
         {
-          (*i)->config_response (r1);
+          connections[r1.channel]->config_response (r1);
           goto out;
         }
       TRACEPRINTF (t, 8, "CONFIG_ACK on unknown channel %d",r1.channel);
@@ -866,7 +1060,8 @@ EIBnetServer::stop_(bool err)
   drop_trigger.stop();
 
   R_ITER(i,connections)
-    (*i)->stop(err);
+    if (*i)
+      (*i)->stop(err);
 
   if (mcast)
     {
@@ -878,6 +1073,7 @@ EIBnetServer::stop_(bool err)
           if(route)
             static_cast<Router &>(router).unregisterLink(c);
         }
+      mcast->flow.stop();
       mcast.reset();
     }
   if (sock)
@@ -934,12 +1130,11 @@ void ConnState::tunnel_request(EIBnet_TunnelRequest &r1, EIBNetIPSocket *isock)
           r2.status = 0;
           if (r1.CEMI[0] == 0x11)
             {
-              out.put (L_Data_ToCEMI (0x2E, c));
-              if (! retries)
-                send_trigger.send();
+              put_out (L_Data_ToCEMI (0x2E, c), false);
+              send_trigger.send();
             }
           if (c->source_address == 0)
-            c->source_address = addr;
+            c.mut()->source_address = addr;
           if (r1.CEMI[0] == 0x11 || r1.CEMI[0] == 0x29)
             recv_L_Data (std::move(c));
           else
@@ -962,40 +1157,17 @@ void ConnState::tunnel_request(EIBnet_TunnelRequest &r1, EIBNetIPSocket *isock)
 void ConnState::tunnel_response (EIBnet_TunnelACK &r1)
 {
   TRACEPRINTF (t, 8, "TUNNEL_ACK");
-  if (sno != r1.seqno)
-    {
-      TRACEPRINTF (t, 8, "Wrong sequence %d<->%d",
-                   r1.seqno, sno);
-      return;
-    }
   if (r1.status != 0)
     {
       TRACEPRINTF (t, 8, "Wrong status %d", r1.status);
       return;
     }
-  if (! retries)
-    {
-      TRACEPRINTF (t, 8, "Unexpected ACK 1");
-      return;
-    }
   if (type != CT_STANDARD && type != CT_BUSMONITOR)
     {
       TRACEPRINTF (t, 8, "Unexpected Connection Type");
       return;
     }
-  sno++;
-
-  out.get ();
-  sendtimeout.stop();
-  reset_timer(); // presumably the client is alive if it can ack
-  retries = 0;
-  if (!out.empty())
-    send_trigger.send();
-  else if (do_send_next)
-    {
-      do_send_next = false;
-      send_Next();
-    }
+  ack (r1.seqno);
 }
 
 void ConnState::config_request(EIBnet_ConfigRequest &r1, EIBNetIPSocket *isock)
@@ -1055,9 +1227,8 @@ void ConnState::config_request(EIBnet_ConfigRequest &r1, EIBNetIPSocket *isock)
               CEMI.setpart (res, 7);
               r2.status = E_NO_ERROR;
 
-              out.push (CEMI);
-              if (! retries)
-                send_trigger.send();
+              put_out (std::move(CEMI), false);
+              send_trigger.send();
             }
           else
             r2.status = E_DATA_CONNECTION;
@@ -1074,38 +1245,16 @@ void ConnState::config_request(EIBnet_ConfigRequest &r1, EIBNetIPSocket *isock)
 void ConnState::config_response (EIBnet_ConfigACK &r1)
 {
   TRACEPRINTF (t, 8, "CONFIG_ACK");
-  if (sno != r1.seqno)
-    {
-      TRACEPRINTF (t, 8, "Wrong sequence %d<->%d",
-                   r1.seqno, sno);
-      return;
-    }
   if (r1.status != 0)
     {
       TRACEPRINTF (t, 8, "Wrong status %d", r1.status);
       return;
     }
-  if (!retries)
-    {
-      TRACEPRINTF (t, 8, "Unexpected ACK 2");
-      return;
-    }
   if (type != CT_CONFIG)
     {
       TRACEPRINTF (t, 8, "Unexpected Connection Type");
       return;
     }
-  sno++;
-  sendtimeout.stop();
-
-  out.get ();
-  retries = 0;
-  if (!out.empty())
-    send_trigger.send();
-  else if (do_send_next)
-    {
-      do_send_next = false;
-      send_Next();
-    }
+  ack (r1.seqno);
 }
 
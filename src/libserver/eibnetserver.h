@@ -27,6 +27,8 @@
 #ifndef EIBNET_SERVER_H
 #define EIBNET_SERVER_H
 
+#include <array>
+#include <deque>
 #include <ev++.h>
 
 #include "callbacks.h"
@@ -64,8 +66,10 @@ public:
 
   eibaddr_t addr;
   uint8_t channel;
+  /** sequence number of the oldest unacknowledged frame */
   uint8_t sno;
   uint8_t rno;
+  /** how often the oldest frame has been retransmitted */
   int retries;
   ConnType type = CT_NONE;
   int no;
@@ -78,9 +82,42 @@ public:
   ev::async send_trigger;
   void send_trigger_cb(ev::async &w, int revents);
   bool do_send_next = false;
-  Queue < CArray > out;
+  /** not a Queue: dropping old frames must skip the ones in flight */
+  std::deque < CArray > out;
   void reset_timer();
 
+  /** max number of unacknowledged frames */
+  unsigned window = 1;
+  /** number of frames at the head of 'out' which have been sent */
+  unsigned inflight = 0;
+  /** when these were sent; zero if they are retransmissions */
+  std::deque < ev_tstamp > sent_at;
+  /** frames in flight which have been sent more than once */
+  unsigned resent = 0;
+  bool fast_resent = false;
+  EIBnetRTO rto;
+  /** handle an ACK; returns false if it doesn't fit */
+  bool ack (uint8_t seqno);
+  /** resend everything in flight */
+  void retransmit ();
+
+  /** queue a frame for the client; returns false if it has been dropped */
+  bool put_out(CArray &&p, bool limit);
+  /** remove the frame at the head of the queue */
+  CArray get_out();
+  /** bytes in the out queue */
+  size_t out_bytes = 0;
+  /** limits for queued monitor frames; zero: no limit */
+  size_t max_out_bytes = 0;
+  unsigned max_out_msgs = 0;
+  QueuePolicy out_policy = QP_DISCONNECT;
+  bool out_overflow = false;
+  /** statistics */
+  unsigned long n_sent = 0;
+  unsigned long n_dropped = 0;
+  unsigned long n_resent = 0;
+  size_t max_queued = 0;
+
   struct sockaddr_in daddr;
   struct sockaddr_in caddr;
 
@@ -91,7 +128,7 @@ public:
   void config_response (EIBnet_ConfigACK &r1);
 
   void send_L_Data (LDataPtr l);
-  void send_L_Busmonitor (LBusmonPtr l);
+  void send_L_Busmonitor (const L_Busmon_PDU & l);
 };
 
 using ConnStatePtr = std::shared_ptr<ConnState>;
@@ -112,12 +149,16 @@ public:
 
   void send_L_Data (LDataPtr l);
 
+  /** rate limiting and ROUTING_BUSY handling */
+  EIBnetRoutingFlow flow;
+
 private:
   EIBNetIPSocket *sock; // receive only
 
   void recv_cb(EIBNetIPPacket *p);
   EIBPacketCallback on_recv;
   void error_cb();
+  void flow_next_cb();
 };
 
 using EIBnetDriverPtr = std::shared_ptr<EIBnetDriver>;
@@ -180,7 +221,13 @@ private:
   IniSectionPtr router_cfg;
   IniSectionPtr tunnel_cfg;
 
-  std::vector < ConnStatePtr > connections;
+  /** open connections, indexed by channel ID (0 is not used) */
+  std::array < ConnStatePtr, 0x100 > connections;
+  /** bitmap of channel IDs in use */
+  uint64_t channels_used[4] = { 1, 0, 0, 0 };
+  /** returns 0 if all channels are in use */
+  uint8_t alloc_channel ();
+  void free_channel (uint8_t id);
   Queue < ConnStatePtr > drop_q;
 
   int addClient (ConnType type, const EIBnet_ConnectRequest & r1,
@@ -67,7 +67,7 @@ CEMI_to_L_Data (const CArray & data, TracePtr tr)
       return nullptr;
     }
 
-  LDataPtr c = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> c(new L_Data_PDU ());
   c->source_address = (data[start + 2] << 8) | (data[start + 3]);
   c->destination_address = (data[start + 4] << 8) | (data[start + 5]);
   c->lsdu.set (data.data() + start + 7, data[6 + start] + 1);
@@ -110,10 +110,10 @@ enum
 cemi_header_type;
 
 CArray
-Busmonitor_to_CEMI (uint8_t code, const LBusmonPtr & p, int no)
+Busmonitor_to_CEMI (uint8_t code, const L_Busmon_PDU & p, int no)
 {
   CArray pdu;
-  pdu.resize (p->lpdu.size() + 9);
+  pdu.resize (p.lpdu.size() + 9);
   pdu[0] = code;
   pdu[1] = 7;        /* AddIL */
   pdu[2] = CEMI_ADD_HEADER_TYPE_STATUS;        /* Type ID = L_Busmon.ind */
@@ -121,10 +121,10 @@ Busmonitor_to_CEMI (uint8_t code, const LBusmonPtr & p, int no)
   pdu[4] = no & 0x7; /* Status */
   pdu[5] = CEMI_ADD_HEADER_TYPE_TIMESTAMP;
   pdu[6] = 2;        // Length of data for TIMESTAMP
-  pdu[7] = (p->time_stamp >> 8) & 0xff;
-  pdu[8] = p->time_stamp & 0xff;
+  pdu[7] = (p.time_stamp >> 8) & 0xff;
+  pdu[8] = p.time_stamp & 0xff;
 
-  pdu.setpart (p->lpdu, 9);
+  pdu.setpart (p.lpdu, 9);
   return pdu;
 }
 
@@ -150,7 +150,7 @@ L_Data_ToEMI (uint8_t code, const LDataPtr & l1)
 LDataPtr
 EMI_to_L_Data (const CArray & data, TracePtr)
 {
-  LDataPtr c = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> c(new L_Data_PDU ());
   unsigned len;
 
   if (data.size() < 8)
@@ -38,7 +38,7 @@ LDataPtr CEMI_to_L_Data (const CArray & data, TracePtr tr);
 
 LBusmonPtr CEMI_to_Busmonitor (const CArray & data, DriverPtr l2);
 
-CArray Busmonitor_to_CEMI (uint8_t code, const LBusmonPtr &p, int no);
+CArray Busmonitor_to_CEMI (uint8_t code, const L_Busmon_PDU &p, int no);
 
 /** convert L_Data_PDU to EMI1/2 frame */
 CArray L_Data_ToEMI (uint8_t code, const LDataPtr & p);
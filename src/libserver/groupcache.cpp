@@ -19,6 +19,13 @@
 
 #include "groupcache.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "apdu.h"
 #include "tpdu.h"
 
@@ -29,18 +36,26 @@ GroupCache::GroupCache (const LinkConnectPtr& c, IniSectionPtr& s)
   TRACEPRINTF (t, 4, "GroupCacheInit");
   enable = 0;
   remtrigger.set<GroupCache, &GroupCache::remtrigger_cb>(this);
+  snapshot_timer.set<GroupCache, &GroupCache::snapshot_timer_cb>(this);
+  read_timer.set<GroupCache, &GroupCache::read_timer_cb>(this);
   addr = c->router.addr;
   c->is_local = true;
+  slabs.emplace_back(new GroupCacheEntry[SLAB_SIZE]);
+  slot_of.assign(0x10000, 0);
 }
 
 GroupCache::~GroupCache ()
 {
   remtrigger.stop();
-  R_ITER(i,reader)
-  {
-    (*i)->stop(false);
-    delete *i;
-  }
+  snapshot_timer.stop();
+  read_timer.stop();
+  // stop() unlinks the reader and moves it to "dead"
+  while (!reader.empty())
+    reader.front()->stop(false);
+  while (!addr_reader.empty())
+    addr_reader.begin()->second.front()->stop(false);
+  ITER(i,dead)
+  delete *i;
   TRACEPRINTF (t, 4, "GroupCacheDestroy");
   Clear ();
 }
@@ -52,6 +67,22 @@ GroupCache::setup()
     return false;
   remtrigger.start();
   this->maxsize = cfg->value("max-size", 0xFFFF);
+  snapshot = cfg->value("snapshot", "");
+  snapshot_interval = cfg->value("snapshot-interval", 0);
+  if (snapshot_interval < 0)
+    {
+      ERRORPRINTF (t, E_ERROR | 148, "snapshot-interval must not be negative");
+      return false;
+    }
+  read_window = cfg->value("read-pending", 3.0) * 1000000;
+  read_rate = cfg->value("read-rate", 0.0);
+  read_burst = cfg->value("read-burst", 10.0);
+  if (read_window < 0 || read_rate < 0 || read_burst < 1)
+    {
+      ERRORPRINTF (t, E_ERROR | 159, "read-pending and read-rate must not be negative, read-burst must be at least 1");
+      return false;
+    }
+  read_tokens = read_burst;
   return true;
 }
 
@@ -59,6 +90,12 @@ void
 GroupCache::start()
 {
   enable = true;
+  if (snapshot.size())
+    {
+      load();
+      if (snapshot_interval > 0)
+        snapshot_timer.start(snapshot_interval, snapshot_interval);
+    }
   Driver::start();
 }
 
@@ -66,9 +103,140 @@ void
 GroupCache::stop(bool err)
 {
   enable = false;
+  snapshot_timer.stop();
+  read_timer.stop();
+  read_queue.clear();
+  inflight.clear();
+  TRACEPRINTF (t, 4, "%lu read requests sent, %lu coalesced, %lu delayed by the rate limit",
+               n_reads, n_coalesced, n_delayed);
+  if (snapshot.size())
+    save();
   Driver::stop(err);
 }
 
+/*
+ * Snapshot file format: the magic string, followed by one record per
+ * entry, oldest first. A record is destination (2 bytes), source (2),
+ * receive time (8, seconds since the epoch), data length (2) and the
+ * data itself; all numbers are big-endian.
+ */
+static const char snapshot_magic[8] = { 'K','N','X','D','G','C','1','\n' };
+
+void
+GroupCache::snapshot_timer_cb(ev::timer &, int)
+{
+  if (dirty)
+    save();
+}
+
+void
+GroupCache::save()
+{
+  CArray buf;
+  buf.set((const uint8_t *)snapshot_magic, sizeof(snapshot_magic));
+  for (const GroupCacheEntry *ep = oldest(); ep; ep = newer(ep))
+    {
+      const GroupCacheEntry &e = *ep;
+      uint64_t tm = e.recvtime;
+      uint8_t hdr[14];
+      hdr[0] = e.dst >> 8;
+      hdr[1] = e.dst & 0xff;
+      hdr[2] = e.src >> 8;
+      hdr[3] = e.src & 0xff;
+      for (int j = 0; j < 8; j++)
+        hdr[4+j] = (tm >> (56 - 8*j)) & 0xff;
+      hdr[12] = e.data.size() >> 8;
+      hdr[13] = e.data.size() & 0xff;
+      buf.setpart(hdr, buf.size(), sizeof(hdr));
+      buf.setpart(e.data.data(), buf.size(), e.data.size());
+    }
+
+  // write to a temporary file, sync it and rename it, so that a crash
+  // or power loss while saving never leaves a truncated snapshot behind
+  std::string tmp = snapshot + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (f == NULL)
+    {
+      ERRORPRINTF (t, E_WARNING | 149, "cannot write cache snapshot %s: %s", tmp, strerror(errno));
+      return;
+    }
+  bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+  ok = (fflush(f) == 0) && ok;
+  ok = (fsync(fileno(f)) == 0) && ok;
+  ok = (fclose(f) == 0) && ok;
+  if (ok && rename(tmp.c_str(), snapshot.c_str()) == 0)
+    {
+      // make the rename itself durable
+      std::string dir = snapshot;
+      size_t slash = dir.rfind('/');
+      dir = (slash == std::string::npos) ? "." : dir.substr(0, slash ? slash : 1);
+      int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+      if (fd >= 0)
+        {
+          fsync(fd);
+          close(fd);
+        }
+      dirty = false;
+      TRACEPRINTF (t, 4, "cache snapshot: %d entries saved", n_entries);
+      return;
+    }
+  ERRORPRINTF (t, E_WARNING | 149, "cannot write cache snapshot %s: %s", snapshot, strerror(errno));
+  unlink(tmp.c_str());
+}
+
+void
+GroupCache::load()
+{
+  // don't clobber live data when we're merely restarted
+  if (n_entries || maxsize == 0)
+    return;
+
+  FILE *f = fopen(snapshot.c_str(), "r");
+  if (f == NULL)
+    {
+      if (errno != ENOENT)
+        ERRORPRINTF (t, E_WARNING | 150, "cannot read cache snapshot %s: %s", snapshot, strerror(errno));
+      return;
+    }
+  CArray buf;
+  uint8_t rd[4096];
+  size_t len;
+  while ((len = fread(rd, 1, sizeof(rd), f)) > 0)
+    buf.setpart(rd, buf.size(), len);
+  fclose(f);
+
+  if (buf.size() < sizeof(snapshot_magic) ||
+      memcmp(buf.data(), snapshot_magic, sizeof(snapshot_magic)))
+    {
+      ERRORPRINTF (t, E_WARNING | 150, "cache snapshot %s: unknown format, ignored", snapshot);
+      return;
+    }
+
+  size_t pos = sizeof(snapshot_magic);
+  while (pos + 14 <= buf.size())
+    {
+      const uint8_t *p = buf.data() + pos;
+      unsigned dlen = (p[12] << 8) | p[13];
+      if (pos + 14 + dlen > buf.size())
+        break;
+      eibaddr_t dst = (p[0] << 8) | p[1];
+      uint64_t tm = 0;
+      for (int j = 0; j < 8; j++)
+        tm = (tm << 8) | p[4+j];
+
+      GroupCacheEntry &e = *touch(dst);
+      e.src = (p[2] << 8) | p[3];
+      // keep the original receive time, so that Read() with an age limit
+      // still asks the bus for stale values
+      e.recvtime = tm;
+      e.data.set(p + 14, dlen);
+      pos += 14 + dlen;
+    }
+  if (pos != buf.size())
+    ERRORPRINTF (t, E_WARNING | 150, "cache snapshot %s: truncated", snapshot);
+  TRACEPRINTF (t, 4, "cache snapshot: %d entries loaded", n_entries);
+}
+
 void
 GroupCache::send_L_Data (LDataPtr lpdu)
 {
@@ -81,35 +249,76 @@ GroupCache::send_L_Data (LDataPtr lpdu)
           if (tpdu1->tsdu.size() >= 2 && !(tpdu1->tsdu[0] & 0x3) &&
               ((tpdu1->tsdu[1] & 0xC0) == 0x40 || (tpdu1->tsdu[1] & 0xC0) == 0x80)) // response or write
             {
-              CacheMap::iterator ci = cache.find (lpdu->destination_address);
-              CacheMap::value_type *c;
-              if (ci == cache.end())
+              GroupCacheEntry *c = touch (lpdu->destination_address);
+              if (c)
                 {
-                  while (cache_seq.size() >= maxsize)
-                    {
-                      SeqMap::iterator si = cache_seq.begin();
-                      cache.erase(si->second);
-                      cache_seq.erase(si);
-                    }
-                  c = &(*cache.emplace(lpdu->destination_address, GroupCacheEntry(lpdu->destination_address)).first);
+                  c->src = lpdu->source_address;
+                  c->data.set (tpdu1->tsdu);
+                  c->recvtime = time (0);
+                  dirty = true;
+                  inflight.erase(c->dst);
+                  updated(*c);
                 }
-              else
-                {
-                  c = &(*ci);
-                  cache_seq.erase(c->second.seq);
-                }
-              c->second.src = lpdu->source_address;
-              c->second.data = tpdu1->tsdu;
-              c->second.recvtime = time (0);
-              c->second.seq = seq++;
-              cache_seq.emplace(c->second.seq,c->first);
-              updated(c->second);
             }
         }
     }
   send_Next();
 }
 
+GroupCacheEntry *
+GroupCache::touch (eibaddr_t ga)
+{
+  uint16_t i = slot_of[ga];
+  if (i)
+    {
+      GroupCacheEntry &e = slot(i);
+      slot(e.prev).next = e.next;
+      slot(e.next).prev = e.prev;
+    }
+  else
+    {
+      if (maxsize == 0)
+        return nullptr;
+      while (n_entries >= maxsize)
+        drop (slot(0).next);
+      if (free_slots)
+        {
+          i = free_slots;
+          free_slots = slot(i).next;
+        }
+      else
+        {
+          if (n_slots == slabs.size() * SLAB_SIZE)
+            slabs.emplace_back(new GroupCacheEntry[SLAB_SIZE]);
+          i = n_slots++;
+        }
+      slot_of[ga] = i;
+      n_entries++;
+      slot(i).dst = ga;
+    }
+
+  // append to the recency list
+  GroupCacheEntry &e = slot(i);
+  e.prev = slot(0).prev;
+  e.next = 0;
+  slot(e.prev).next = i;
+  slot(0).prev = i;
+  e.seq = seq++;
+  return &e;
+}
+
+void
+GroupCache::drop (uint16_t i)
+{
+  GroupCacheEntry &e = slot(i);
+  slot(e.prev).next = e.next;
+  slot(e.next).prev = e.prev;
+  slot_of[e.dst] = 0;
+  e.next = free_slots;
+  free_slots = i;
+  n_entries--;
+}
+
 bool
 GroupCache::Start ()
 {
@@ -122,7 +331,9 @@ void
 GroupCache::Clear ()
 {
   TRACEPRINTF (t, 4, "GroupCacheClear");
-  cache.clear();
+  while (slot(0).next)
+    drop (slot(0).next);
+  dirty = true;
 }
 
 void
@@ -136,11 +347,10 @@ GroupCache::Stop ()
 void
 GroupCache::remove (eibaddr_t ga)
 {
-  CacheMap::iterator f = cache.find(ga);
-  if (f != cache.end())
+  if (slot_of[ga])
     {
-      cache_seq.erase(f->second.seq);
-      cache.erase(f);
+      drop (slot_of[ga]);
+      dirty = true;
     }
 }
 
@@ -150,6 +360,14 @@ GroupCacheReader::GroupCacheReader(GroupCache *gc)
   gc->add(this);
 }
 
+GroupCacheReader::GroupCacheReader(GroupCache *gc, eibaddr_t addr)
+{
+  this->gc = gc;
+  this->addr = addr;
+  this->all_addrs = false;
+  gc->add(this);
+}
+
 GroupCacheReader::~GroupCacheReader()
 {
 }
@@ -166,53 +384,72 @@ GroupCacheReader::stop(bool err)
 void
 GroupCache::add (GroupCacheReader * entry)
 {
-  reader.push_back(entry);
+  if (entry->all_addrs)
+    entry->pos = reader.insert(reader.end(), entry);
+  else
+    {
+      ReaderList &l = addr_reader[entry->addr];
+      entry->pos = l.insert(l.end(), entry);
+    }
 }
 
 void
 GroupCache::updated(GroupCacheEntry &c)
 {
-  // do this in reverse so that the update handler can safely remove itself
-  R_ITER(i,reader)
-  (*i)->updated(c);
+  // Advance the iterator before calling the reader, so that the update
+  // handler can safely remove itself
+  auto ar = addr_reader.find(c.dst);
+  if (ar != addr_reader.end())
+    {
+      ReaderList &l = ar->second;
+      updating = &l;
+      for (ReaderList::iterator i = l.begin(); i != l.end(); )
+        (*i++)->updated(c);
+      updating = nullptr;
+      // a reader may have added another address, which invalidates "ar"
+      if (l.empty())
+        addr_reader.erase(c.dst);
+    }
+  for (ReaderList::iterator i = reader.begin(); i != reader.end(); )
+    (*i++)->updated(c);
 }
 
 void
-GroupCache::remove (GroupCacheReader *)
+GroupCache::remove (GroupCacheReader *r)
 {
+  if (r->all_addrs)
+    reader.erase(r->pos);
+  else
+    {
+      auto ar = addr_reader.find(r->addr);
+      ar->second.erase(r->pos);
+      if (ar->second.empty() && &ar->second != updating)
+        addr_reader.erase(ar);
+    }
+  dead.push_back(r);
   remtrigger.send();
 }
 
 void
 GroupCache::remtrigger_cb(ev::async &, int)
 {
-  // erase() doesn't do reverse iterators
-  //R_ITER(i,reader)
-  unsigned int i = reader.size();
-  while(i--)
-    {
-      GroupCacheReader *r = reader[i];
-      if (!r->stopped)
-        continue;
-      delete r;
-      reader.erase(reader.begin()+i);
-    }
+  ITER(i,dead)
+  delete *i;
+  dead.clear();
 }
 
 class GCReader : protected GroupCacheReader
 {
   GCReadCallback cb;
   ClientConnPtr cc;
-  eibaddr_t addr;
   uint16_t age;
   ev::timer timeout;
 public:
   GCReader(GroupCache *gc, eibaddr_t addr, int Timeout, uint16_t age,
-           GCReadCallback cb, ClientConnPtr cc) : GroupCacheReader(gc)
+           GCReadCallback cb, ClientConnPtr cc) : GroupCacheReader(gc, addr)
   {
     this->cb = cb;
     this->cc = cc;
-    this->addr = addr;
     this->age = age;
     timeout.set<GCReader,&GCReader::timeout_cb>(this);
     timeout.start(Timeout,0);
@@ -265,14 +502,14 @@ GroupCache::Read (eibaddr_t addr, unsigned Timeout, uint16_t age,
       return;
     }
 
-  CacheMap::iterator c = cache.find (addr);
-  if (c != cache.end() && age && c->second.recvtime + age < time (0))
-    c = cache.end();
-  if (c != cache.end())
+  const GroupCacheEntry *c = find (addr);
+  if (c && age && c->recvtime + age < time (0))
+    c = nullptr;
+  if (c)
     {
       TRACEPRINTF (t, 4, "GroupCache found: %s",
-                   FormatEIBAddr (c->second.src).c_str());
-      cb(c->second, Timeout == 0, cc);
+                   FormatEIBAddr (c->src).c_str());
+      cb(*c, Timeout == 0, cc);
       return;
     }
 
@@ -284,15 +521,147 @@ GroupCache::Read (eibaddr_t addr, unsigned Timeout, uint16_t age,
       return;
     }
 
-  // No data fond. Send a Read request.
+  // No data found. Send a Read request, unless there already is one.
+  new GCReader(this,addr,Timeout,age, cb,cc);
+  request_read(addr, false);
+}
+
+/** Ranges longer than this only report what's cached; we don't know
+ * which of their addresses exist on the bus. */
+#define READ_MULTI_MAX_RANGE 256
+/** A single request doesn't send more reads than this */
+#define READ_MULTI_MAX_READS 256
+
+void
+GroupCache::ReadMulti (const std::vector<GroupRange> &ranges, uint16_t age,
+                       bool read, GCMultiCallback cb, ClientConnPtr cc)
+{
+  std::vector < const GroupCacheEntry * > res;
+
+  TRACEPRINTF (t, 4, "GroupCacheReadMulti %d ranges %d %d",
+               (int)ranges.size(), age, read);
+  if (!enable)
+    {
+      TRACEPRINTF (t, 4, "GroupCache not enabled");
+      cb(res, cc);
+      return;
+    }
+
+  time_t now = time (0);
+  std::vector<GroupRange> merged;
+  for (std::vector<GroupRange>::const_iterator r = ranges.begin();
+       r != ranges.end(); r++)
+    if (r->first <= r->second)
+      merged.push_back (*r);
+
+  // Report every address once, in ascending order, so that the client
+  // can continue a truncated reply at a single group address.
+  std::sort (merged.begin(), merged.end());
+  unsigned next = 0;
+  int reads = 0;
+  for (std::vector<GroupRange>::const_iterator r = merged.begin();
+       r != merged.end(); r++)
+    {
+      bool r_read = read && r->second - r->first < READ_MULTI_MAX_RANGE;
+      for (unsigned a = std::max<unsigned>(r->first, next); a <= r->second; a++)
+        {
+          const GroupCacheEntry *c = find (a);
+          if (c && !(age && c->recvtime + age < now))
+            res.push_back (c);
+          else if (r_read && reads < READ_MULTI_MAX_READS)
+            {
+              request_read(a, true);
+              reads++;
+            }
+          next = a + 1;
+        }
+    }
+  if (reads == READ_MULTI_MAX_READS)
+    TRACEPRINTF (t, 4, "GroupCacheReadMulti: read limit reached");
+  cb(res, cc);
+}
+
+void
+GroupCache::request_read (eibaddr_t addr, bool forced)
+{
+  timestamp_t now = getTime();
+  auto in = inflight.find(addr);
+  if (in != inflight.end() && (in->second.queued || in->second.sent + read_window > now))
+    {
+      TRACEPRINTF (t, 4, "GroupCache read pending");
+      if (forced)
+        in->second.forced = true;
+      n_coalesced++;
+      return;
+    }
+  if (take_token())
+    {
+      send_read(addr);
+      return;
+    }
+
+  TRACEPRINTF (t, 4, "GroupCache read delayed");
+  n_delayed++;
+  inflight[addr] = GroupCacheInflight { now, true, forced };
+  read_queue.put(std::move(addr));
+  if (!read_timer.is_active())
+    read_timer.start((1 - read_tokens) / read_rate, 0);
+}
+
+bool
+GroupCache::take_token()
+{
+  if (read_rate == 0)
+    return true;
+  timestamp_t now = getTime();
+  read_tokens += (now - read_refill) / 1000000. * read_rate;
+  if (read_tokens > read_burst)
+    read_tokens = read_burst;
+  read_refill = now;
+  if (read_tokens < 1)
+    return false;
+  read_tokens -= 1;
+  return true;
+}
+
+void
+GroupCache::read_timer_cb(ev::timer &, int)
+{
+  while (!read_queue.empty())
+    {
+      eibaddr_t a = read_queue.front();
+      auto in = inflight.find(a);
+      bool forced = in != inflight.end() && in->second.forced;
+      if ((!forced && addr_reader.find(a) == addr_reader.end())
+          || (in != inflight.end() && !in->second.queued))
+        {
+          // nobody waits any more, or the value arrived, or a read was sent
+          if (in != inflight.end() && in->second.queued)
+            inflight.erase(in);
+          read_queue.pop();
+          continue;
+        }
+      if (!take_token())
+        break;
+      read_queue.pop();
+      send_read(a);
+    }
+  if (!read_queue.empty())
+    read_timer.start((1 - read_tokens) / read_rate, 0);
+}
+
+void
+GroupCache::send_read(eibaddr_t addr)
+{
   A_GroupValue_Read_PDU apdu;
   T_Data_Group_PDU tpdu;
-  LDataPtr lpdu;
+  std::unique_ptr<L_Data_PDU> lpdu;
 
-  new GCReader(this,addr,Timeout,age, cb,cc);
+  inflight[addr] = GroupCacheInflight { getTime(), false, false };
+  n_reads++;
 
   tpdu.tsdu = apdu.ToPacket ();
-  lpdu = LDataPtr(new L_Data_PDU ());
+  lpdu.reset (new L_Data_PDU ());
   lpdu->lsdu = tpdu.ToPacket ();
   lpdu->source_address = 0;
   lpdu->destination_address = addr;
@@ -302,10 +671,12 @@ GroupCache::Read (eibaddr_t addr, unsigned Timeout, uint16_t age,
 
 class GCTracker : protected GroupCacheReader
 {
-  GCLastCallback cb;
+  GCLastCallback cb = nullptr;
+  GCValuesCallback vcb = nullptr;
   ClientConnPtr cc;
   ev::timer timeout;
   std::vector < eibaddr_t > a;
+  std::vector < const GroupCacheEntry * > v;
   uint32_t start;
 public:
   bool stopped = false;
@@ -314,12 +685,13 @@ public:
             GCLastCallback cb, ClientConnPtr cc) : GroupCacheReader(gc)
   {
     this->cb = cb;
-    this->cc = cc;
-    this->start = start;
-    timeout.set<GCTracker,&GCTracker::timeout_cb>(this);
-    timeout.start(Timeout,0);
-    if (start != gc->seq)
-      handler();
+    init (start, Timeout, cc);
+  }
+  GCTracker(GroupCache *gc, uint32_t start, int Timeout,
+            GCValuesCallback vcb, ClientConnPtr cc) : GroupCacheReader(gc)
+  {
+    this->vcb = vcb;
+    init (start, Timeout, cc);
   }
   virtual ~GCTracker()
   {
@@ -333,6 +705,16 @@ public:
     GroupCacheReader::stop(err);
   }
 private:
+  void init(uint32_t start, int Timeout, ClientConnPtr cc)
+  {
+    this->cc = cc;
+    this->start = start;
+    timeout.set<GCTracker,&GCTracker::timeout_cb>(this);
+    timeout.start(Timeout,0);
+    if (start != gc->seq)
+      handler();
+  }
+
   void updated(GroupCacheEntry &)
   {
     if (stopped)
@@ -347,21 +729,31 @@ private:
       return;
     if (handler())
       return;
-    cb(a,gc->seq,cc);
+    if (vcb)
+      vcb(v,gc->seq,cc);
+    else
+      cb(a,gc->seq,cc);
     stop(true);
   }
 
   bool handler()
   {
     TRACEPRINTF (gc->t, 8, "LastUpdates start: x%x pos: x%x", start, gc->seq);
-    SeqMap::const_iterator sa = gc->cache_seq.begin();
-    SeqMap::const_iterator sb = gc->cache_seq.end();
-    while (sb != sa && (--sb)->first >= start)
+    if (vcb)
       {
-        a.push_back (sb->second);
-        if (sb->first == start)
-          break;
+        // oldest first, so that a truncated reply can be continued
+        const GroupCacheEntry *e = gc->newest(), *first = nullptr;
+        for (; e && e->seq >= start; e = gc->older(e))
+          first = e;
+        for (e = first; e; e = gc->newer(e))
+          v.push_back (e);
+        vcb(v,gc->seq,cc);
+        stop(false);
+        return true;
       }
+    for (const GroupCacheEntry *e = gc->newest(); e && e->seq >= start;
+         e = gc->older(e))
+      a.push_back (e->dst);
     cb(a,gc->seq,cc);
     stop(false);
     return true;
@@ -387,3 +779,10 @@ GroupCache::LastUpdates2 (uint32_t start, uint8_t Timeout,
   new GCTracker(this, start, Timeout, cb,cc);
 }
 
+void
+GroupCache::LastValues (uint32_t start, uint8_t Timeout,
+                        GCValuesCallback cb, ClientConnPtr cc)
+{
+  new GCTracker(this, start, Timeout, cb,cc);
+}
+
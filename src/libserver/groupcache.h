@@ -27,53 +27,121 @@
 #ifndef GROUPCACHE_H
 #define GROUPCACHE_H
 
+#include <cstring>
 #include <ctime>
-#include <map>
+#include <list>
+#include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "client.h"
 #include "link.h"
 
 class GroupCache;
 
+/** The data of a cache entry. Values of standard frames are stored
+ * inline; longer ones get a buffer. That buffer is kept when a short
+ * value arrives, so that an address which alternates between the two
+ * doesn't allocate again. */
+class GroupCacheData
+{
+public:
+  /** bytes stored inline: APCI plus 14 bytes of data */
+  static const unsigned inline_size = 16;
+
+  const uint8_t *data() const
+  {
+    return len > inline_size ? ext.get() : buf;
+  }
+  unsigned size() const
+  {
+    return len;
+  }
+  void set (const uint8_t *p, unsigned n)
+  {
+    if (n > 0xffff)
+      n = 0xffff;
+    if (n > inline_size && n > ext_size)
+      {
+        ext.reset(new uint8_t[n]);
+        ext_size = n;
+      }
+    memcpy (n > inline_size ? ext.get() : buf, p, n);
+    len = n;
+  }
+  void set (const CArray &a)
+  {
+    set (a.data(), a.size());
+  }
+
+private:
+  uint16_t len = 0;
+  uint8_t buf[inline_size];
+  uint16_t ext_size = 0;
+  std::unique_ptr<uint8_t[]> ext;
+};
+
 struct GroupCacheEntry
 {
-  GroupCacheEntry(eibaddr_t dst)
+  GroupCacheEntry(eibaddr_t dst = 0)
   {
     this->dst = dst;
   }
   /** Layer 4 data */
-  CArray data;
+  GroupCacheData data;
   /** source address */
   eibaddr_t src = 0;
   /** destination address */
   eibaddr_t dst;
   /** receive time */
-  time_t recvtime;
+  time_t recvtime = 0;
   /** seqnum */
-  uint32_t seq;
+  uint32_t seq = 0;
+  /** recency list, as slot numbers; owned by GroupCache */
+  uint16_t prev = 0, next = 0;
 };
 
 typedef void (*GCReadCallback)(const GroupCacheEntry &foo, bool nowait, ClientConnPtr c);
 typedef void (*GCLastCallback)(const std::vector<eibaddr_t> &foo, uint32_t end, ClientConnPtr c);
+typedef void (*GCValuesCallback)(const std::vector<const GroupCacheEntry *> &foo, uint32_t end, ClientConnPtr c);
+typedef void (*GCMultiCallback)(const std::vector<const GroupCacheEntry *> &foo, ClientConnPtr c);
+
+/** a range of group addresses, both ends included */
+using GroupRange = std::pair<eibaddr_t, eibaddr_t>;
+
+class GroupCacheReader;
+using ReaderList = std::list<GroupCacheReader *>;
 
 class GroupCacheReader
 {
 public:
+  /** a reader which is interested in every update */
   GroupCacheReader(GroupCache *);
+  /** a reader which is only interested in this address */
+  GroupCacheReader(GroupCache *, eibaddr_t addr);
   virtual ~GroupCacheReader();
 
   bool stopped = false;
   GroupCache *gc;
   virtual void updated(GroupCacheEntry &) = 0;
   virtual void stop(bool err);
-};
 
-/** map last-updated sequence numbers to group addresses */
-using SeqMap = std::map<uint32_t, eibaddr_t>;
+  /** the address we wait for, unless all_addrs is set */
+  eibaddr_t addr = 0;
+  bool all_addrs = true;
+  /** our position in GroupCache's reader lists */
+  ReaderList::iterator pos;
+};
 
-/** map group addresses to cache entries */
-using CacheMap = std::unordered_map<eibaddr_t, GroupCacheEntry>;
+/** a read request for a group address, sent to the bus or waiting for
+ * the rate limiter */
+struct GroupCacheInflight
+{
+  timestamp_t sent;
+  bool queued;
+  /** send even if no reader waits for the result */
+  bool forced;
+};
 
 class GroupCache:public Driver
 {
@@ -112,10 +180,8 @@ public: // but only for GroupCacheReader
   /** remove an address from the cache */
   void remove (eibaddr_t ga);
 
-  /** seqnum of last entry */
+  /** seqnum of the next entry */
   uint32_t seq = 0;
-  /** map seqnum to group address */
-  SeqMap cache_seq;
 
   /** Turn on caching, calls l3.registerGroupCallBack(ANY) */
   bool Start ();
@@ -127,16 +193,85 @@ public: // but only for GroupCacheReader
   /** read, and optionally wait for, a cache entry for this address */
   void Read (eibaddr_t addr, unsigned timeout, uint16_t age,
              GCReadCallback cb, ClientConnPtr c);
+  /** return the cached entries of several address ranges at once.
+   * The ranges may overlap and come in any order; the entries are
+   * returned in ascending address order, each once.
+   * Entries older than age seconds are skipped. If read is set, send
+   * read requests for the addresses skipped within short ranges. */
+  void ReadMulti (const std::vector<GroupRange> &ranges, uint16_t age,
+                  bool read, GCMultiCallback cb, ClientConnPtr c);
   /** incrementally monitor group cache updates */
   void LastUpdates (uint16_t start, uint8_t timeout,
                     GCLastCallback cb, ClientConnPtr c);
   void LastUpdates2 (uint32_t start, uint8_t timeout,
                      GCLastCallback cb, ClientConnPtr c);
+  /** like LastUpdates2, but return the cache entries, oldest first */
+  void LastValues (uint32_t start, uint8_t timeout,
+                   GCValuesCallback cb, ClientConnPtr c);
+
+  bool isEnabled () const
+  {
+    return enable;
+  }
+
+  /** the cache entry for this address, or NULL */
+  const GroupCacheEntry *find (eibaddr_t ga) const
+  {
+    return slot_of[ga] ? &slot(slot_of[ga]) : nullptr;
+  }
+  /** walk the cache in update order; NULL at either end */
+  const GroupCacheEntry *oldest () const
+  {
+    return entry(slot(0).next);
+  }
+  const GroupCacheEntry *newest () const
+  {
+    return entry(slot(0).prev);
+  }
+  const GroupCacheEntry *older (const GroupCacheEntry *e) const
+  {
+    return entry(e->prev);
+  }
+  const GroupCacheEntry *newer (const GroupCacheEntry *e) const
+  {
+    return entry(e->next);
+  }
 
 private:
-  std::vector < GroupCacheReader * > reader;
-  /** The Cache */
-  CacheMap cache;
+  /** readers which want to see every update */
+  ReaderList reader;
+  /** readers which want to see updates of one address */
+  std::unordered_map<eibaddr_t, ReaderList> addr_reader;
+  /** stopped readers, deleted by remtrigger_cb */
+  std::vector < GroupCacheReader * > dead;
+  /** the list in addr_reader whose readers we're calling, if any */
+  ReaderList *updating = nullptr;
+  /** The Cache. Entries live in slabs of SLAB_SIZE slots; slot_of maps
+   * each group address to its slot, zero if not cached. Slot 0 is the
+   * head of a circular list of all entries, ordered by their last
+   * update; free slots are chained through "next". */
+  static const unsigned SLAB_SIZE = 256;
+  std::vector < std::unique_ptr < GroupCacheEntry[] > > slabs;
+  std::vector < uint16_t > slot_of;
+  /** number of entries */
+  unsigned n_entries = 0;
+  /** slots ever used, including slot 0 */
+  unsigned n_slots = 1;
+  uint16_t free_slots = 0;
+
+  GroupCacheEntry &slot (uint16_t i) const
+  {
+    return slabs[i / SLAB_SIZE][i % SLAB_SIZE];
+  }
+  const GroupCacheEntry *entry (uint16_t i) const
+  {
+    return i ? &slot(i) : nullptr;
+  }
+  /** the entry for this address, created if necessary and moved to
+   * the end of the recency list; NULL if the cache holds nothing */
+  GroupCacheEntry *touch (eibaddr_t ga);
+  /** drop the entry in this slot */
+  void drop (uint16_t i);
   /** controlled by .Start/Stop; if false, the whole code does nothing */
   bool enable = false;
   /** max size of cache */
@@ -144,6 +279,45 @@ private:
   /** cached copy of main address */
   eibaddr_t addr;
 
+  /** file to persist the cache in, if any */
+  std::string snapshot;
+  /** seconds between periodic snapshots; 0: only on shutdown */
+  int snapshot_interval = 0;
+  /** set when the cache changed since the last snapshot */
+  bool dirty = false;
+  ev::timer snapshot_timer;
+  void snapshot_timer_cb(ev::timer &w, int revents);
+  /** write the cache to the snapshot file */
+  void save();
+  /** refill an empty cache from the snapshot file */
+  void load();
+
+  /** read requests we're waiting for. Further readers of the same
+   * address don't cause another request while one is pending. */
+  std::unordered_map<eibaddr_t, GroupCacheInflight> inflight;
+  /** how long a request counts as pending, in usec */
+  timestamp_t read_window;
+  /** token bucket for read requests; no limit if read_rate is zero */
+  float read_rate;
+  float read_burst;
+  float read_tokens = 0;
+  timestamp_t read_refill = 0;
+  bool take_token();
+  /** requests waiting for a token */
+  Queue < eibaddr_t > read_queue;
+  ev::timer read_timer;
+  void read_timer_cb(ev::timer &w, int revents);
+  /** send a read request to the bus, unless one is pending; obeys the
+   * rate limit. Unless forced, a delayed request is dropped when
+   * nobody waits for it any more. */
+  void request_read(eibaddr_t addr, bool forced);
+  /** send a read request to the bus */
+  void send_read(eibaddr_t addr);
+  /** statistics */
+  unsigned long n_reads = 0;
+  unsigned long n_coalesced = 0;
+  unsigned long n_delayed = 0;
+
   ev::async remtrigger;
   void remtrigger_cb(ev::async &w, int revents);
   /** signal that this entry has been updated */
@@ -51,7 +51,7 @@ ReadCallback(const GroupCacheEntry &gce, bool nowait, ClientConnPtr c)
   erg[3] = (gce.src >> 0) & 0xff;
   erg[4] = (gce.dst >> 8) & 0xff;
   erg[5] = (gce.dst >> 0) & 0xff;
-  erg.setpart (gce.data, 6);
+  erg.setpart (gce.data.data(), 6, gce.data.size());
   c->sendmessage (erg.size(), erg.data());
 }
 
@@ -91,6 +91,109 @@ LastUpdates2Callback(const std::vector<eibaddr_t> &addrs, uint32_t end, ClientCo
   c->sendmessage (erg.size(), erg.data());
 }
 
+/** Reply with all changed entries: the next start position, then
+ * seq(4) dst(2) src(2) age(2) len(1) data per entry. Stops early if the
+ * message would get too long; the client continues at the returned
+ * position. */
+void
+LastValuesCallback(const std::vector<const GroupCacheEntry *> &ents, uint32_t end, ClientConnPtr c)
+{
+  CArray erg;
+  time_t now = time (0);
+  unsigned int pos = 6;
+
+  erg.resize (6);
+  EIBSETTYPE (erg, EIB_CACHE_LAST_VALUES);
+  for (unsigned int i = 0; i < ents.size(); i++)
+    {
+      const GroupCacheEntry *e = ents[i];
+      unsigned int dlen = e->data.size();
+      if (dlen > 0xff)
+        dlen = 0xff;
+      if (pos + 11 + dlen > EIB_MAX_MESSAGE)
+        {
+          end = e->seq;
+          break;
+        }
+      time_t age = now - e->recvtime;
+      if (age < 0)
+        age = 0;
+      else if (age > 0xffff)
+        age = 0xffff;
+
+      erg.resize (pos + 11 + dlen);
+      erg[pos + 0] = (e->seq >> 24) & 0xff;
+      erg[pos + 1] = (e->seq >> 16) & 0xff;
+      erg[pos + 2] = (e->seq >> 8) & 0xff;
+      erg[pos + 3] = (e->seq >> 0) & 0xff;
+      erg[pos + 4] = (e->dst >> 8) & 0xff;
+      erg[pos + 5] = (e->dst >> 0) & 0xff;
+      erg[pos + 6] = (e->src >> 8) & 0xff;
+      erg[pos + 7] = (e->src >> 0) & 0xff;
+      erg[pos + 8] = (age >> 8) & 0xff;
+      erg[pos + 9] = (age >> 0) & 0xff;
+      erg[pos + 10] = dlen;
+      erg.setpart (e->data.data(), pos + 11, dlen);
+      pos += 11 + dlen;
+    }
+  erg[2] = (end >> 24) & 0xff;
+  erg[3] = (end >> 16) & 0xff;
+  erg[4] = (end >> 8) & 0xff;
+  erg[5] = (end >> 0) & 0xff;
+  c->sendmessage (erg.size(), erg.data());
+}
+
+/** Reply with the cached entries: the group address to continue at if
+ * the reply had to be cut short (else zero), then dst(2) src(2) age(2)
+ * len(1) data per entry. A reply without position means that the cache
+ * is disabled.
+ *
+ * The entries are sorted by address, so the continuation applies to all
+ * requested ranges alike. It can't be zero: at least one entry, with a
+ * lower address, always fits. */
+void
+ReadMultiCallback(const std::vector<const GroupCacheEntry *> &ents, ClientConnPtr c)
+{
+  CArray erg;
+  time_t now = time (0);
+  unsigned int pos = 4;
+  eibaddr_t next = 0;
+
+  erg.resize (4);
+  EIBSETTYPE (erg, EIB_CACHE_READ_MULTI);
+  for (unsigned int i = 0; i < ents.size(); i++)
+    {
+      const GroupCacheEntry *e = ents[i];
+      unsigned int dlen = e->data.size();
+      if (dlen > 0xff)
+        dlen = 0xff;
+      if (pos + 7 + dlen > EIB_MAX_MESSAGE)
+        {
+          next = e->dst;
+          break;
+        }
+      time_t age = now - e->recvtime;
+      if (age < 0)
+        age = 0;
+      else if (age > 0xffff)
+        age = 0xffff;
+
+      erg.resize (pos + 7 + dlen);
+      erg[pos + 0] = (e->dst >> 8) & 0xff;
+      erg[pos + 1] = (e->dst >> 0) & 0xff;
+      erg[pos + 2] = (e->src >> 8) & 0xff;
+      erg[pos + 3] = (e->src >> 0) & 0xff;
+      erg[pos + 4] = (age >> 8) & 0xff;
+      erg[pos + 5] = (age >> 0) & 0xff;
+      erg[pos + 6] = dlen;
+      erg.setpart (e->data.data(), pos + 7, dlen);
+      pos += 7 + dlen;
+    }
+  erg[2] = (next >> 8) & 0xff;
+  erg[3] = (next >> 0) & 0xff;
+  c->sendmessage (erg.size(), erg.data());
+}
+
 void
 GroupCacheRequest (ClientConnPtr c, uint8_t *buf, size_t len)
 {
@@ -178,6 +281,41 @@ GroupCacheRequest (ClientConnPtr c, uint8_t *buf, size_t len)
       break;
     }
 
+    case EIB_CACHE_LAST_VALUES:
+    {
+      if (len < 7)
+        {
+          c->sendreject ();
+          return;
+        }
+      uint32_t start = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
+      uint8_t timeout = buf[6];
+      cache->LastValues (start, timeout, &LastValuesCallback, c);
+      break;
+    }
+
+    case EIB_CACHE_READ_MULTI:
+    {
+      if (len < 5 || (len - 5) % 4)
+        {
+          c->sendreject ();
+          return;
+        }
+      std::vector<GroupRange> ranges;
+      age = (buf[2] << 8) | buf[3];
+      bool read = buf[4] & 1;
+      if (!cache->isEnabled ())
+        {
+          c->sendreject (EIB_CACHE_READ_MULTI);
+          return;
+        }
+      for (unsigned int i = 5; i < len; i += 4)
+        ranges.push_back (GroupRange ((buf[i] << 8) | buf[i + 1],
+                                      (buf[i + 2] << 8) | buf[i + 3]));
+      cache->ReadMulti (ranges, age, read, &ReadMultiCallback, c);
+      break;
+    }
+
     default:
       c->sendreject ();
     }
@@ -32,6 +32,15 @@ T_Group::T_Group (T_Reader<GroupComm> *app, LinkConnectClientPtr lc, eibaddr_t g
   groupaddr = group;
 }
 
+bool
+T_Group::setup ()
+{
+  if (!Layer4commonWO::setup())
+    return false;
+  subscribeGroup (groupaddr);
+  return true;
+}
+
 void
 T_Group::send_L_Data (LDataPtr lpdu)
 {
@@ -54,7 +63,7 @@ T_Group::recv_Data (const CArray & c)
   tpdu.tsdu = c;
   std::string s = tpdu.Decode (t);
   TRACEPRINTF (t, 4, "Recv Group %s", s);
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = groupaddr;
   lpdu->address_type = GroupAddress;
@@ -105,7 +114,7 @@ T_Broadcast::recv_Data (const CArray & c)
   tpdu.tsdu = c;
   std::string s = tpdu.Decode (t);
   TRACEPRINTF (t, 4, "Recv Broadcast %s", s);
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = 0;
   lpdu->address_type = GroupAddress;
@@ -139,7 +148,7 @@ void
 T_TPDU::recv_Data (const TpduComm & c)
 {
   t->TracePacket (4, "Recv TPDU", c.data);
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = src;
   lpdu->destination_address = c.addr;
   lpdu->address_type = IndividualAddress;
@@ -199,7 +208,7 @@ T_Individual::recv_Data (const CArray & c)
   tpdu.tsdu = c;
   std::string s = tpdu.Decode (t);
   TRACEPRINTF (t, 4, "Recv Individual %s", s);
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = dest;
   lpdu->address_type = IndividualAddress;
@@ -324,7 +333,7 @@ T_Connection::SendConnect ()
 {
   TRACEPRINTF (t, 4, "SendConnect");
   T_Connect_PDU tpdu;
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = dest;
   lpdu->address_type = IndividualAddress;
@@ -345,7 +354,7 @@ T_Connection::SendDisconnect ()
 {
   TRACEPRINTF (t, 4, "SendDisconnect");
   T_Disconnect_PDU tpdu;
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = dest;
   lpdu->address_type = IndividualAddress;
@@ -362,7 +371,7 @@ T_Connection::SendAck (int sequence_number)
   TRACEPRINTF (t, 4, "SendACK %d", sequence_number);
   T_ACK_PDU tpdu;
   tpdu.sequence_number = sequence_number;
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = dest;
   lpdu->address_type = IndividualAddress;
@@ -379,7 +388,7 @@ T_Connection::SendData (int sequence_number, const CArray & c)
   tpdu.tsdu = c;
   tpdu.sequence_number = sequence_number;
   TRACEPRINTF (t, 4, "SendData %s", tpdu.Decode (t));
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = dest;
   lpdu->address_type = IndividualAddress;
@@ -456,7 +465,7 @@ GroupSocket::recv_Data (const GroupAPDU & c)
   tpdu.tsdu = c.data;
   std::string s = tpdu.Decode (t);
   TRACEPRINTF (t, 4, "Recv GroupSocket %s %s", FormatGroupAddr(c.dst), s);
-  LDataPtr lpdu = LDataPtr(new L_Data_PDU ());
+  std::unique_ptr<L_Data_PDU> lpdu(new L_Data_PDU ());
   lpdu->source_address = 0;
   lpdu->destination_address = c.dst;
   lpdu->address_type = GroupAddress;
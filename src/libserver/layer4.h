@@ -53,6 +53,15 @@ class Layer4commonWO:public Layer4common<COMM>
 public:
   Layer4commonWO (T_Reader<COMM> *app, LinkConnectClientPtr lc, bool write_only) : Layer4common<COMM>(app,lc), write_only(write_only) {}
 
+  virtual bool setup()
+  {
+    if (!Layer4common<COMM>::setup())
+      return false;
+    if (write_only)
+      this->subscribeNoGroups();
+    return true;
+  }
+
   virtual bool checkAddress(eibaddr_t addr) const
   {
     return !write_only && addr == this->getAddress();
@@ -111,6 +120,9 @@ public:
   T_Group (T_Reader<GroupComm> *app, LinkConnectClientPtr lc, eibaddr_t group, bool write_only);
   virtual ~T_Group ();
 
+  /** subscribes to our group address */
+  virtual bool setup();
+
   /** enqueues a packet from L3 */
   void send_L_Data (LDataPtr l);
   /** send APDU to L3 */
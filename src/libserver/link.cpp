@@ -242,6 +242,7 @@ LinkConnectSingle::setup()
     addr = static_cast<Router &>(router).get_client_addr(t);
   if (addr == 0)
     return false;
+  static_cast<Router &>(router).claimAddress(std::dynamic_pointer_cast<LinkConnect>(shared_from_this()), addr);
   return true;
 }
 
@@ -306,6 +307,17 @@ Driver::findFilter(std::string name, bool skip_me)
   return r->findFilter(name);
 }
 
+void
+BusDriver::addAddress(eibaddr_t addr)
+{
+  if (addrs[addr])
+    return;
+  addrs[addr] = true;
+  auto c = std::dynamic_pointer_cast<LinkConnect>(conn.lock());
+  if (c != nullptr)
+    static_cast<Router &>(c->router).claimAddress(c, addr, true);
+}
+
 bool
 LineDriver::setup()
 {
@@ -320,6 +332,22 @@ LineDriver::setup()
   return true;
 }
 
+void
+LineDriver::subscribeGroup(eibaddr_t group)
+{
+  auto c = std::dynamic_pointer_cast<LinkConnect>(conn.lock());
+  if (c != nullptr)
+    static_cast<Router&>(c->router).subscribeGroup(c, group);
+}
+
+void
+LineDriver::subscribeNoGroups()
+{
+  auto c = std::dynamic_pointer_cast<LinkConnect>(conn.lock());
+  if (c != nullptr)
+    static_cast<Router&>(c->router).subscribeNoGroups(c);
+}
+
 bool
 LinkConnect::setup()
 {
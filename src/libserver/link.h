@@ -480,6 +480,18 @@ public:
   /** last state change */
   time_t changed = 0;
 
+  /** Set if this link told the router which group addresses it wants,
+   * see Router::subscribeGroup(). Otherwise the router needs to ask
+   * checkGroupAddress() about every group telegram. */
+  bool group_indexed = false;
+  /** the group addresses this link has subscribed to */
+  std::vector<eibaddr_t> groups;
+  /** the individual addresses this link has claimed, see
+   * Router::claimAddress() */
+  std::vector<eibaddr_t> claimed;
+  /** … and those the router learned from its traffic */
+  std::vector<eibaddr_t> learned;
+
   /** This is the main flow control mechanism. Whenever "send_more" is set,
    * the router may call "send_L_Data" ONCE. It will then wait for
    * "send_Next" to be called before sending the next message.
@@ -836,10 +848,8 @@ public:
     return addrs[addr];
   }
 
-  virtual void addAddress(eibaddr_t addr)
-  {
-    addrs[addr] = true;
-  }
+  /** also tells the router, see Router::claimAddress() */
+  virtual void addAddress(eibaddr_t addr);
 
   virtual bool checkAddress (eibaddr_t) const
   {
@@ -889,6 +899,12 @@ public:
   }
 
 protected:
+  /** Tell the router that this line only wants to see this group address.
+   * May be called more than once. */
+  void subscribeGroup(eibaddr_t group);
+  /** Tell the router that this line doesn't want any group telegrams. */
+  void subscribeNoGroups();
+
   virtual bool hasAddress(eibaddr_t addr) const
   {
     return addr == this->_addr;
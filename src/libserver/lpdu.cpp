@@ -24,6 +24,8 @@
 #include "cm_tp1.h"
 #include "tpdu.h"
 
+unsigned long LDataPtr::n_copies = 0;
+
 /* L_Data */
 
 std::string L_Data_PDU::Decode (TracePtr tr) const
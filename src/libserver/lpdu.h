@@ -128,7 +128,65 @@ public:
   }
 };
 
-using LDataPtr = std::unique_ptr<L_Data_PDU>;
+/** A reference to an L_Data frame. Copies share the frame, so that
+ * the router can hand one telegram to any number of links without
+ * copying it. The frame is read-only through the pointer; code which
+ * changes it calls mut(), which makes a private copy first if the
+ * frame is shared. */
+class LDataPtr
+{
+public:
+  LDataPtr () = default;
+  LDataPtr (std::nullptr_t) { }
+  explicit LDataPtr (L_Data_PDU *l) : p(l) { }
+  LDataPtr (std::unique_ptr<L_Data_PDU> &&l) : p(std::move(l)) { }
+
+  const L_Data_PDU *operator-> () const
+  {
+    return p.get();
+  }
+  const L_Data_PDU &operator* () const
+  {
+    return *p;
+  }
+  const L_Data_PDU *get () const
+  {
+    return p.get();
+  }
+  explicit operator bool () const
+  {
+    return p != nullptr;
+  }
+  bool operator== (std::nullptr_t) const
+  {
+    return p == nullptr;
+  }
+  bool operator!= (std::nullptr_t) const
+  {
+    return p != nullptr;
+  }
+  void reset ()
+  {
+    p.reset();
+  }
+
+  /** the frame, for changing it */
+  L_Data_PDU *mut ()
+  {
+    if (p.use_count() > 1)
+      {
+        p = std::make_shared<L_Data_PDU>(*p);
+        n_copies++;
+      }
+    return p.get();
+  }
+
+  /** number of frames copied by mut() */
+  static unsigned long n_copies;
+
+private:
+  std::shared_ptr<L_Data_PDU> p;
+};
 
 /* L_SystemBroadcast */
 
@@ -226,8 +284,9 @@ class L_Busmonitor_CallBack
 public:
   L_Busmonitor_CallBack(std::string& n) : name(n) { }
   std::string& name;
-  /** callback: a bus monitor frame has been received */
-  virtual void send_L_Busmonitor (LBusmonPtr l) = 0;
+  /** callback: a bus monitor frame has been received.
+   * The frame is shared by all monitors, so copy what you need. */
+  virtual void send_L_Busmonitor (const L_Busmon_PDU & l) = 0;
 };
 
 /* L_Service_Information */
@@ -317,7 +317,8 @@ ManagementConnection::ManagementConnection (ClientConnPtr c, uint8_t *buf, size_
               memaddr_t addr = (c->buf[2] << 8) | (c->buf[3]);
               unsigned len = (c->buf[4] << 8) | (c->buf[5]);
               CArray data, erg;
-              if (m.X_Memory_Read_Block (addr, len, data) == -1)
+              if (len > EIB_MAX_MESSAGE - 2
+                  || m.X_Memory_Read_Block (addr, len, data) == -1)
                 c->sendreject ();
               else
                 {
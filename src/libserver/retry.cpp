@@ -105,7 +105,7 @@ RetryFilter::send_L_Data (LDataPtr l)
         ERRORPRINTF(t, E_WARNING | 137, "spurious send");
       else
         {
-          msg = LDataPtr(new L_Data_PDU (*l));
+          msg = l;
           timeout.start(send_timeout, 0);
           Filter::send_L_Data(std::move(l));
         }
@@ -235,7 +235,7 @@ RetryFilter::trigger_cb (ev::async &, int)
 
     case R_UP:
       if (msg)
-        Filter::send_L_Data(LDataPtr(new L_Data_PDU (*msg)));
+        Filter::send_L_Data(msg);
       break;
 
     default:
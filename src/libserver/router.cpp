@@ -19,6 +19,7 @@
 
 #include "router.h"
 
+#include <algorithm>
 #include <iostream>
 #include <math.h>
 #include <sys/socket.h>
@@ -132,6 +133,9 @@ public:
   }
 };
 
+/** size of a bucket in the repeat filter */
+#define IGNORE_WAYS 4
+
 static Factory<Server> _servers;
 static Factory<Driver> _drivers;
 static Factory<Filter> _filters;
@@ -199,6 +203,26 @@ Router::setup()
   force_broadcast = s->value("force-broadcast", false);
   unknown_ok = s->value("unknown-ok", false);
 
+  {
+    ignore_window = s->value("repeat-window", 1.0) * 1000000;
+    int slots = s->value("repeat-slots", 1024);
+    if (ignore_window < 0 || slots < IGNORE_WAYS)
+      {
+        ERRORPRINTF (t, E_ERROR | 147, "repeat-window must not be negative, repeat-slots must be at least %d.", IGNORE_WAYS);
+        goto ex;
+      }
+    ignore.resize ((slots + IGNORE_WAYS - 1) / IGNORE_WAYS * IGNORE_WAYS);
+    ITER(i, ignore)
+    i->end = 0;
+  }
+
+  route_age = s->value("route-age", 300.0) * 1000000;
+  if (route_age < 0)
+    {
+      ERRORPRINTF (t, E_ERROR | 153, "route-age must not be negative.");
+      goto ex;
+    }
+
   x = s->value("addr","");
   if (!x.size())
     {
@@ -467,6 +491,8 @@ void
 Router::linkStateChanged(const LinkConnectPtr& link)
 {
   TRACEPRINTF (link->t, 4, "link state changed: %s", link->stateName());
+  // whatever was behind this link may have moved while it was away
+  route_forget(link);
   linkChanges.push(link);
   state_trigger.send();
 }
@@ -641,7 +667,8 @@ Router::started()
 void
 Router::stopped(bool err)
 {
-  TRACEPRINTF (t, 4, "down");
+  TRACEPRINTF (t, 4, "down: %lu frames routed, %lu copies, %lu repeats dropped", n_frames, LDataPtr::n_copies, n_repeats);
+  TRACEPRINTF (t, 4, "down: %lu unicast frames sent to the destination's link, %lu flooded", n_route_hits, n_route_misses);
   if (want_up)
     stop(err);
   else
@@ -686,9 +713,7 @@ Router::recv_L_Data (LDataPtr l, LinkConnect& link)
   // Unassigned source: set to link's, or our, address
   if (l->source_address == 0)
     {
-      l->source_address = link.addr;
-      if (l->source_address == 0)
-        l->source_address = addr;
+      l.mut()->source_address = link.addr ? link.addr : addr;
     }
 
   if (l->source_address == addr)
@@ -720,7 +745,10 @@ Router::recv_L_Data (LDataPtr l, LinkConnect& link)
       link.addAddress (l->source_address);
     }
 
-  l->source = &link;
+  if (l->source_address != addr && l->source_address != 0xFFFF)
+    route_refresh (l->source_address, link, getTime ());
+
+  l.mut()->source = &link;
   r_high->recv_L_Data(std::move(l));
 }
 
@@ -827,6 +855,17 @@ Router::registerLink(const LinkConnectPtr& link, bool transient)
     }
   TRACEPRINTF (link->t, 3, "registerLink: %d:%s", link->pos,n);
   links_changed = true;
+  if (link->group_indexed)
+    {
+      ITER(i, link->groups)
+      group_subs[*i].push_back(link);
+    }
+  else
+    group_links.emplace(link->pos, link);
+  ITER(i, link->claimed)
+  addr_owner.emplace(*i, AddrOwner{link, false, 0});
+  ITER(i, link->learned)
+  addr_owner.emplace(*i, AddrOwner{link, true, 0});
   if (transient)
     link->transient = true;
   if (want_up)
@@ -850,6 +889,23 @@ Router::unregisterLink(const LinkConnectPtr& link)
       return false;
     }
   links.erase(res);
+  if (link->group_indexed)
+    {
+      ITER(i, link->groups)
+      {
+        auto gs = group_subs.find(*i);
+        if (gs == group_subs.end())
+          continue;
+        auto &v = gs->second;
+        v.erase(std::remove(v.begin(), v.end(), link), v.end());
+        if (v.empty())
+          group_subs.erase(gs);
+      }
+    }
+  else
+    group_links.erase(link->pos);
+  release_addresses(link, link->claimed);
+  release_addresses(link, link->learned);
   TRACEPRINTF (link->t, 3, "unregisterLink: %s", n);
   links_changed = true;
   if (!in_link_loop)
@@ -857,6 +913,36 @@ Router::unregisterLink(const LinkConnectPtr& link)
   return true;
 }
 
+bool
+Router::isRegistered(const LinkConnectPtr& link) const
+{
+  auto res = links.find(link->pos);
+  return res != links.end() && res->second == link;
+}
+
+void
+Router::subscribeNoGroups(const LinkConnectPtr& link)
+{
+  if (link->group_indexed)
+    return;
+  link->group_indexed = true;
+  if (isRegistered(link))
+    group_links.erase(link->pos);
+}
+
+void
+Router::subscribeGroup(const LinkConnectPtr& link, eibaddr_t group)
+{
+  subscribeNoGroups(link);
+  ITER(i, link->groups)
+  if (*i == group)
+    return;
+  link->groups.push_back(group);
+  TRACEPRINTF (link->t, 3, "subscribe %s", FormatGroupAddr (group));
+  if (isRegistered(link))
+    group_subs[group].push_back(link);
+}
+
 bool
 Router::hasAddress (eibaddr_t addr, LinkConnectPtr& link, bool quiet) const
 {
@@ -874,24 +960,14 @@ Router::hasAddress (eibaddr_t addr, LinkConnectPtr& link, bool quiet) const
       return false;
     }
 
-  C_ITER(i, links)
-  {
-    if (i->second == link)
-      continue;
-    if (i->second->hasAddress (addr))
-      {
-        if (i->second == link)
-          {
-            if (!quiet)
-              TRACEPRINTF (link->t, 8, "local addr %s", FormatEIBAddr (addr));
-            return false;
-          }
-        if (!quiet)
-          TRACEPRINTF (i->second->t, 8, "found addr %s", FormatEIBAddr (addr));
-        link = i->second;
-        return true;
-      }
-  }
+  auto o = addr_owner.find(addr);
+  if (o != addr_owner.end() && o->second.link != link)
+    {
+      if (!quiet)
+        TRACEPRINTF (o->second.link->t, 8, "found addr %s", FormatEIBAddr (addr));
+      link = o->second.link;
+      return true;
+    }
 
   if (!quiet)
     TRACEPRINTF (t, 8, "unknown addr %s", FormatEIBAddr (addr));
@@ -921,7 +997,17 @@ Router::checkGroupAddress (eibaddr_t addr, LinkConnectPtr link) const
   if (addr == 0) // always accept broadcast
     return true;
 
-  C_ITER(i, links)
+  auto gs = group_subs.find(addr);
+  if (gs != group_subs.end())
+    C_ITER(i, gs->second)
+    {
+      if (*i == link)
+        continue;
+      if ((*i)->checkGroupAddress (addr))
+        return true;
+    }
+
+  C_ITER(i, group_links)
   {
     if (i->second == link)
       continue;
@@ -932,6 +1018,38 @@ Router::checkGroupAddress (eibaddr_t addr, LinkConnectPtr link) const
   return false;
 }
 
+void
+Router::claimAddress(const LinkConnectPtr& link, eibaddr_t addr, bool learned)
+{
+  auto& v = learned ? link->learned : link->claimed;
+  for (auto i = v.begin(); i != v.end(); i++)
+    if (*i == addr)
+      return;
+  v.push_back(addr);
+  if (isRegistered(link))
+    addr_owner.emplace(addr, AddrOwner{link, learned, learned ? getTime () : 0});
+}
+
+void
+Router::release_addresses(const LinkConnectPtr& link, const std::vector<eibaddr_t>& addrs)
+{
+  for (auto i = addrs.begin(); i != addrs.end(); i++)
+    {
+      auto o = addr_owner.find(*i);
+      if (o == addr_owner.end() || o->second.link != link)
+        continue;
+      addr_owner.erase(o);
+      // some other link might know this address too. We don't know
+      // when it was last seen there, so it starts out stale.
+      ITER(j, links)
+      if (j->second->hasAddress(*i))
+        {
+          addr_owner.emplace(*i, AddrOwner{j->second, true, 0});
+          break;
+        }
+    }
+}
+
 eibaddr_t
 Router::get_client_addr (TracePtr t)
 {
@@ -989,6 +1107,27 @@ Router::release_client_addr(eibaddr_t addr)
   client_addrs[pos] = false;
 }
 
+/** FNV-1a hash of the parts of a frame which a repeat doesn't change */
+static uint64_t
+frame_hash (const L_Data_PDU &l)
+{
+  uint64_t h = 14695981039346656037ULL;
+  auto add = [&h](uint8_t c)
+  {
+    h = (h ^ c) * 1099511628211ULL;
+  };
+  add (l.priority);
+  add (l.address_type);
+  add (l.hop_count);
+  add (l.source_address >> 8);
+  add (l.source_address & 0xFF);
+  add (l.destination_address >> 8);
+  add (l.destination_address & 0xFF);
+  C_ITER (i, l.lsdu)
+  add (*i);
+  return h;
+}
+
 void
 Router::trigger_cb (ev::async &, int)
 {
@@ -1002,7 +1141,7 @@ Router::trigger_cb (ev::async &, int)
           l2->lpdu.set (L_Data_to_CM_TP1 (l1));
 
           ITER(i,vbusmonitor)
-          i->cb->send_L_Busmonitor (LBusmonPtr(new L_Busmon_PDU (*l2)));
+          i->cb->send_L_Busmonitor (*l2);
         }
       if (!l1->hop_count)
         {
@@ -1010,28 +1149,24 @@ Router::trigger_cb (ev::async &, int)
           goto next;
         }
       if (l1->hop_count < 7 || !force_broadcast)
-        l1->hop_count--;
+        l1.mut()->hop_count--;
 
-      if (l1->repeated)
-        {
-          CArray d1 = L_Data_to_CM_TP1 (l1);
-          ITER (i,ignore)
-          if (d1 == i->data)
-            {
-              TRACEPRINTF (t, 9, "Drop: %s", l1->Decode (t));
-              goto next;
-            }
-        }
-      l1->repeated = 1;
-      ignore.push_back((IgnoreInfo)
       {
-        .data = L_Data_to_CM_TP1 (l1), .end = getTime () + 1000000
-      });
-      l1->repeated = 0;
+        uint64_t h = frame_hash (*l1);
+        timestamp_t now = getTime ();
+        if (l1->repeated && is_repeat (h, now))
+          {
+            n_repeats++;
+            TRACEPRINTF (t, 9, "Drop: %s", l1->Decode (t));
+            goto next;
+          }
+        add_repeat (h, now);
+      }
+      l1.mut()->repeated = 0;
 
       if (l1->address_type == IndividualAddress
           && l1->destination_address == this->addr)
-        l1->destination_address = 0;
+        l1.mut()->destination_address = 0;
 
       low_send_more = false;
       r_low->send_L_Data(std::move(l1));
@@ -1041,15 +1176,71 @@ next:
 
   if (!low_send_more)
     TRACEPRINTF (t, 6, "wait L");
+}
+
+bool
+Router::is_repeat (uint64_t hash, timestamp_t now) const
+{
+  if (ignore.empty())
+    return false;
+  size_t b = hash % (ignore.size() / IGNORE_WAYS) * IGNORE_WAYS;
+  for (size_t i = b; i < b + IGNORE_WAYS; i++)
+    if (ignore[i].hash == hash && ignore[i].end >= now)
+      return true;
+  return false;
+}
 
-  // Timestamps are ordered, so we scan for the first
-  timestamp_t tm = getTime ();
-  ITER (i, ignore)
-  if (i->end >= tm)
+void
+Router::add_repeat (uint64_t hash, timestamp_t now)
+{
+  if (ignore.empty())
+    return;
+  // re-use a slot with this hash, else the oldest one
+  size_t b = hash % (ignore.size() / IGNORE_WAYS) * IGNORE_WAYS;
+  size_t best = b;
+  for (size_t i = b; i < b + IGNORE_WAYS; i++)
     {
-      ignore.erase (ignore.begin(), i);
-      break;
+      if (ignore[i].hash == hash)
+        {
+          best = i;
+          break;
+        }
+      if (ignore[i].end < ignore[best].end)
+        best = i;
     }
+  ignore[best].hash = hash;
+  ignore[best].end = now + ignore_window;
+}
+
+LinkConnectPtr
+Router::route_lookup (eibaddr_t addr, timestamp_t now) const
+{
+  auto o = addr_owner.find(addr);
+  if (o == addr_owner.end())
+    return nullptr;
+  const AddrOwner& a = o->second;
+  if (a.learned && (a.seen == 0 || a.seen + route_age <= now))
+    return nullptr;
+  return a.link;
+}
+
+void
+Router::route_refresh (eibaddr_t addr, LinkConnect& link, timestamp_t now)
+{
+  auto o = addr_owner.find(addr);
+  if (o != addr_owner.end() && o->second.learned && &*o->second.link == &link)
+    o->second.seen = now;
+}
+
+void
+Router::route_forget (const LinkConnectPtr& link)
+{
+  ITER(i, link->learned)
+  {
+    auto o = addr_owner.find(*i);
+    if (o != addr_owner.end() && o->second.link == link)
+      o->second.seen = 0;
+  }
 }
 
 bool
@@ -1069,47 +1260,46 @@ Router::send_L_Data(LDataPtr l1)
   high_send_more = false;
 
   auto source = l1->source;
-  l1->source = nullptr;
+  l1.mut()->source = nullptr;
 
   if (l1->address_type == GroupAddress)
     {
       // This is easy: send to all other L2 which subscribe to the
-      // group.
-      ITER(i, links)
-      {
-        auto ii = i->second;
-        if (ii->state != L_up)
-          continue;
-        if ((l1->source_address == 0xFFFF) // programming
-             ? &*ii == source
-             : ii->hasAddress(l1->source_address))
-          continue; // don't return to same interface
-        if(!has_send_more(ii))
-          continue; // internal error if not
-        if (ii->checkGroupAddress(l1->destination_address))
-          ii->send_L_Data (LDataPtr(new L_Data_PDU (*l1)));
-      }
+      // group. Links which told us which groups they want are looked
+      // up in the index, all others need to be asked.
+      auto gs = group_subs.find(l1->destination_address);
+      if (gs != group_subs.end())
+        ITER(i, gs->second)
+        if (wants_L_Data_Group(*i, *l1, source))
+          fanout.push_back(*i);
+      ITER(i, group_links)
+      if (wants_L_Data_Group(i->second, *l1, source))
+        fanout.push_back(i->second);
     }
   else if (l1->address_type == IndividualAddress)
     {
-      // we want to send to the interface on which the destination address
-      // has appeared. If it hasn't been seen yet, we send to all
-      // interfaces.
+      // we want to send to the interface which owns the destination
+      // address: it's assigned there, or has recently appeared there.
+      // Otherwise we send to all interfaces which might know it.
       // Address ~0 is special; it's used for programming
       // so can be on different interfaces. Always broadcast these.
+      // Telegrams with hop count 7 are routed as before.
       bool found = (l1->destination_address == this->addr);
-      if (l1->destination_address != 0xFFFF)
-        ITER(i, links)
+      LinkConnectPtr dest = nullptr;
+      if (!found && l1->destination_address != 0xFFFF && l1->hop_count != 7)
+        dest = route_lookup (l1->destination_address, getTime ());
+      if (dest != nullptr)
         {
-          auto ii = i->second;
-          if (ii->hasAddress (l1->source_address))
-            continue;
-          if (ii->hasAddress (l1->destination_address))
-            {
-              found = true;
-              break;
-            }
+          // Nothing to do if that's where the frame came from: both ends
+          // are on the same line.
+          n_route_hits++;
+          if (dest->state == L_up && &*dest != source
+              && !dest->hasAddress (l1->source_address)
+              && has_send_more(dest))
+            fanout.push_back(dest);
+          goto send;
         }
+      n_route_misses++;
       ITER (i, links)
       {
         auto ii = i->second;
@@ -1120,13 +1310,46 @@ Router::send_L_Data(LDataPtr l1)
         if(!has_send_more(ii))
           continue; // internal error if not
         if (l1->hop_count == 7 || found ? ii->hasAddress (l1->destination_address) : ii->checkAddress (l1->destination_address))
-          i->second->send_L_Data (LDataPtr(new L_Data_PDU (*l1)));
+          fanout.push_back(ii);
       }
     }
+
+send:
+  // All recipients share the frame; a filter which changes it gets
+  // its own copy (see LDataPtr::mut).
+  if (!fanout.empty())
+    {
+      auto last = std::prev(fanout.end());
+      ITER(i, fanout)
+      {
+        if (i == last)
+          (*i)->send_L_Data (std::move(l1));
+        else
+          (*i)->send_L_Data (l1);
+      }
+      TRACEPRINTF (t, 6, "sent to %d links", fanout.size());
+      fanout.clear();
+    }
+  n_frames++;
+
   high_sending = false;
   send_Next(); // check readiness
 }
 
+bool
+Router::wants_L_Data_Group(const LinkConnectPtr& ii, const L_Data_PDU& l1, void *source)
+{
+  if (ii->state != L_up)
+    return false;
+  if ((l1.source_address == 0xFFFF) // programming
+       ? &*ii == source
+       : ii->hasAddress(l1.source_address))
+    return false; // don't return to same interface
+  if(!has_send_more(ii))
+    return false; // internal error if not
+  return ii->checkGroupAddress(l1.destination_address);
+}
+
 void
 Router::mtrigger_cb (ev::async &, int)
 {
@@ -1136,7 +1359,7 @@ Router::mtrigger_cb (ev::async &, int)
 
       TRACEPRINTF (t, 3, "RecvMon %s", l1->Decode (t));
       ITER (i, busmonitor)
-      i->cb->send_L_Busmonitor (LBusmonPtr(new L_Busmon_PDU (*l1)));
+      i->cb->send_L_Busmonitor (*l1);
     }
 }
 
@@ -55,12 +55,23 @@ struct Busmonitor_Info
   L_Busmonitor_CallBack *cb;
 };
 
+/** a recently-forwarded frame, see Router::is_repeat() */
 struct IgnoreInfo
 {
-  CArray data;
+  uint64_t hash;
   timestamp_t end;
 };
 
+/** the link which has an individual address, see Router::claimAddress() */
+struct AddrOwner
+{
+  LinkConnectPtr link;
+  /** learned from traffic instead of assigned, thus may go stale */
+  bool learned;
+  /** when a learned address was last seen; zero after its link changed state */
+  timestamp_t seen;
+};
+
 class Router : public BaseRouter
 {
   friend class RouterLow;
@@ -109,6 +120,13 @@ public:
   /** unregister a new link */
   bool unregisterLink(const LinkConnectPtr& link);
 
+  /** Only send group telegrams for this address to the link (plus any
+   * other addresses it subscribes to). The link's checkGroupAddress()
+   * is still consulted, so this is a pre-filter. */
+  void subscribeGroup(const LinkConnectPtr& link, eibaddr_t group);
+  /** Don't send any group telegrams to this link. */
+  void subscribeNoGroups(const LinkConnectPtr& link);
+
   /** register a busmonitor callback, return true, if successful*/
   bool registerBusmonitor (L_Busmonitor_CallBack * c);
   /** register a vbusmonitor callback, return true, if successful*/
@@ -119,6 +137,16 @@ public:
   /** deregister a vbusmonitor callback, return true, if successful*/
   bool deregisterVBusmonitor (L_Busmonitor_CallBack * c);
 
+  /** number of telegrams waiting to be routed */
+  size_t queue_length() const
+  {
+    return buf.size();
+  }
+
+  /** Note that this link has this individual address, see hasAddress().
+   * "learned" is set if the address was seen in traffic from that link. */
+  void claimAddress(const LinkConnectPtr& link, eibaddr_t addr, bool learned = false);
+
   /** Get a free dynamic address */
   eibaddr_t get_client_addr (TracePtr t);
   /** … and release it */
@@ -199,6 +227,23 @@ private:
   /** interfaces */
   std::unordered_map<int, LinkConnectPtr> links;
 
+  /** group address => interfaces which subscribed to it */
+  std::unordered_map<eibaddr_t, std::vector<LinkConnectPtr>> group_subs;
+  /** interfaces which didn't subscribe, thus need to check every group telegram */
+  std::unordered_map<int, LinkConnectPtr> group_links;
+  /** individual address => the registered interface which claimed it */
+  std::unordered_map<eibaddr_t, AddrOwner> addr_owner;
+  /** drop this link's entries in addr_owner, when it goes away */
+  void release_addresses(const LinkConnectPtr& link, const std::vector<eibaddr_t>& addrs);
+  /** is this link in our link table? */
+  bool isRegistered(const LinkConnectPtr& link) const;
+  /** check whether this link wants this group telegram */
+  bool wants_L_Data_Group(const LinkConnectPtr& link, const L_Data_PDU& l1, void *source);
+  /** links to send the current telegram to. Kept here to avoid reallocating. */
+  std::vector<LinkConnectPtr> fanout;
+  /** statistics: frames routed */
+  unsigned long n_frames = 0;
+
   /** queue of interfaces which called linkChanged() */
   Queue<LinkConnectPtr> linkChanges;
 
@@ -213,8 +258,30 @@ private:
   /** buffer queues for receiving from L2 */
   Queue < LDataPtr > buf;
   Queue < LBusmonPtr > mbuf;
-  /** buffer for packets to ignore when repeat flag is set */
+  /** Recently-forwarded frames, to ignore when the repeat flag is set.
+   * Set-associative: a frame's hash selects a bucket of IGNORE_WAYS slots.
+   * Entries simply expire; there's no cleanup pass. */
   std::vector < IgnoreInfo > ignore;
+  /** how long to remember forwarded frames, in usec */
+  timestamp_t ignore_window = 1000000;
+  /** number of repeated frames we dropped */
+  unsigned long n_repeats = 0;
+  /** check whether we've recently forwarded this frame */
+  bool is_repeat (uint64_t hash, timestamp_t now) const;
+  /** … and remember that we did */
+  void add_repeat (uint64_t hash, timestamp_t now);
+
+  /** how long a learned address stays valid for unicast, in usec */
+  timestamp_t route_age = 300000000;
+  /** statistics: unicast frames sent to the address's owner, or flooded */
+  unsigned long n_route_hits = 0;
+  unsigned long n_route_misses = 0;
+  /** the link to send unicast telegrams for this address to, if known */
+  LinkConnectPtr route_lookup (eibaddr_t addr, timestamp_t now) const;
+  /** note that this address was seen on this link */
+  void route_refresh (eibaddr_t addr, LinkConnect& link, timestamp_t now);
+  /** mark all addresses learned on this link as stale */
+  void route_forget (const LinkConnectPtr& link);
 
   /** Start of address block to assign dynamically to clients */
   eibaddr_t client_addrs_start;
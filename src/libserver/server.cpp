@@ -136,6 +136,13 @@ NetServer::setup()
     return false;
   if (!static_cast<Router &>(router).checkStack(cfg))
     return false;
+  queue_bytes = cfg->value("queue-size", 1024*1024);
+  queue_msgs = cfg->value("queue-messages", 0);
+  if (!parseQueuePolicy(cfg->value("queue-policy", "disconnect"), queue_policy))
+    {
+      ERRORPRINTF (t, E_ERROR | 151, "%s: queue-policy must be one of disconnect, drop-oldest, drop-newest", name());
+      return false;
+    }
   return true;
 }
 
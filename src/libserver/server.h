@@ -48,6 +48,11 @@ protected:
   /** server socket */
   int fd;
 
+  /** send queue limits for client connections */
+  size_t queue_bytes;
+  unsigned queue_msgs;
+  QueuePolicy queue_policy = QP_DISCONNECT;
+
   virtual void setupConnection (int cfd);
 
   bool setup();
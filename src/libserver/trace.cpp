@@ -19,9 +19,16 @@
 
 #include "trace.h"
 
+#include <atomic>
+#include <cerrno>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 static bool trace_started = false;
 
@@ -35,10 +42,9 @@ std::string Trace::fullname() const
   return name+'/'+auxname;
 }
 
-void
-Trace::TraceHeader (const int layer)
+static void
+time_since (struct timeval &tv, const struct timeval &started)
 {
-  struct timeval tv;
   gettimeofday(&tv, NULL);
   if (tv.tv_usec < started.tv_usec)
     {
@@ -47,6 +53,327 @@ Trace::TraceHeader (const int layer)
     }
   tv.tv_usec -= started.tv_usec;
   tv.tv_sec -= started.tv_sec;
+}
+
+/*
+ * The trace buffer.
+ *
+ * Formatting and writing trace lines is slow, so with "trace-buffer" set
+ * the tracers only copy a small binary record into a ring buffer. A
+ * separate thread renders the records and writes them to stdout.
+ *
+ * The ring is a bounded lock-free queue (Vyukov's design): each slot has
+ * a sequence number which tells producers and the consumer whether the
+ * slot is free, resp. filled. If the ring is full, records are dropped
+ * and counted; the event loop never waits for the writer.
+ *
+ * An idle writer blocks on an eventfd. It sets tb_sleeping before it
+ * looks at the ring a last time; a producer which finds the flag set
+ * clears it and wakes the writer, so only the first record after an idle
+ * period costs a system call.
+ *
+ * Packet records hold the raw bytes and are formatted by the writer.
+ * Text records hold the message, formatted by the caller: the arguments
+ * are arbitrary C++ objects which we can't keep around.
+ */
+
+#define TRACEBUF_NAME 40
+#define TRACEBUF_MSG 24
+#define TRACEBUF_DATA 256
+
+struct TraceRecord
+{
+  std::atomic<size_t> pos;
+  struct timeval tv;
+  unsigned int seq;
+  uint8_t layer;
+  bool timestamps;
+  bool packet;
+  /** text: the message didn't fit into data */
+  bool truncated;
+  /** packet: original length; text: bytes in data */
+  unsigned int len;
+  char name[TRACEBUF_NAME];
+  char msg[TRACEBUF_MSG];
+  uint8_t data[TRACEBUF_DATA];
+};
+
+static TraceRecord *tb_ring = nullptr;
+static size_t tb_size = 0;
+static std::atomic<size_t> tb_head(0);
+static std::atomic<size_t> tb_tail(0);
+static std::atomic<unsigned long> tb_dropped(0);
+static std::string tb_servername;
+
+static pthread_t tb_thread;
+static bool tb_running = false;
+static std::atomic<bool> tb_stopping(false);
+static std::atomic<bool> tb_sleeping(false);
+static int tb_wakeup = -1;
+
+/** append one complete line for this record */
+static void
+tb_render (std::string &out, TraceRecord *r)
+{
+  if (tb_servername.length())
+    out += fmt::sprintf("%s: ", tb_servername);
+  if (r->timestamps)
+    out += fmt::sprintf ("Layer %d [%2d:%-*s %u.%03u] ", r->layer, r->seq, trace_namelen, r->name,
+                         (unsigned int)r->tv.tv_sec, (unsigned int)r->tv.tv_usec/1000);
+  else
+    out += fmt::sprintf ("Layer %d [%2d:%s] ", r->layer, r->seq, r->name);
+  if (r->packet)
+    {
+      static const char hex[] = "0123456789ABCDEF";
+      out += fmt::sprintf ("%s(%03d):", r->msg, r->len);
+      unsigned int len = r->len < TRACEBUF_DATA ? r->len : TRACEBUF_DATA;
+      for (unsigned int i = 0; i < len; i++)
+        {
+          out += ' ';
+          out += hex[r->data[i] >> 4];
+          out += hex[r->data[i] & 0x0f];
+        }
+      if (len < r->len)
+        out += " ...";
+    }
+  else
+    {
+      out.append ((const char *)r->data, r->len);
+      if (r->truncated)
+        out += " ...";
+    }
+  out += '\n';
+}
+
+/** write whole lines with as few calls as possible, so that they don't
+ * get mixed up with error messages written by the main thread */
+static void
+tb_write (std::string &out)
+{
+  size_t done = 0;
+  fflush (stdout);
+  while (done < out.size())
+    {
+      ssize_t i = write (fileno(stdout), out.data() + done, out.size() - done);
+      if (i <= 0)
+        {
+          if (i < 0 && errno == EINTR)
+            continue;
+          break;
+        }
+      done += i;
+    }
+  out.clear();
+}
+
+static void
+tb_wake ()
+{
+  // can only fail if the counter overflows, which it won't
+  uint64_t one = 1;
+  ssize_t i = write (tb_wakeup, &one, sizeof(one));
+  (void) i;
+}
+
+static void *
+tb_writer (void *)
+{
+  std::string out;
+  while (true)
+    {
+      size_t tail = tb_tail.load(std::memory_order_relaxed);
+      TraceRecord *r = &tb_ring[tail & (tb_size-1)];
+      if (r->pos.load(std::memory_order_acquire) == tail+1)
+        {
+          tb_render(out, r);
+          r->pos.store(tail + tb_size, std::memory_order_release);
+          tb_tail.store(tail+1, std::memory_order_release);
+          if (out.size() >= 4096)
+            tb_write(out);
+          continue;
+        }
+
+      unsigned long dropped = tb_dropped.exchange(0);
+      if (dropped)
+        out += fmt::sprintf ("%lu trace records dropped\n", dropped);
+      tb_write(out);
+      if (tb_stopping)
+        break;
+
+      // check the ring again after announcing that we're going to sleep
+      tb_sleeping.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (r->pos.load(std::memory_order_acquire) == tail+1 || tb_stopping)
+        {
+          tb_sleeping.store(false);
+          continue;
+        }
+      uint64_t n;
+      if (read (tb_wakeup, &n, sizeof(n)) < 0 && errno != EINTR)
+        break;
+    }
+  return NULL;
+}
+
+static void
+tb_start_thread ()
+{
+  if (pthread_create (&tb_thread, NULL, tb_writer, NULL) == 0)
+    tb_running = true;
+}
+
+/** wait for the writer to catch up */
+static void
+tb_drain ()
+{
+  if (!tb_running)
+    return;
+  while (tb_tail.load() != tb_head.load())
+    {
+      struct timespec ts = { 0, 1000*1000 };
+      nanosleep (&ts, NULL);
+    }
+  fflush (stdout);
+}
+
+static void
+tb_atfork_child ()
+{
+  // the writer thread didn't survive the fork; restart it lazily
+  tb_running = false;
+  tb_sleeping = false;
+}
+
+static struct TraceBufferStop
+{
+  ~TraceBufferStop()
+  {
+    if (!tb_running)
+      return;
+    tb_stopping = true;
+    tb_wake();
+    pthread_join (tb_thread, NULL);
+    tb_running = false;
+  }
+} tb_stop;
+
+static bool
+trace_buffer_init (unsigned int size, const std::string &servername)
+{
+  if (tb_ring)
+    return true;
+  tb_wakeup = eventfd (0, EFD_CLOEXEC);
+  if (tb_wakeup < 0)
+    return false;
+  tb_size = 16;
+  while (tb_size < size && tb_size < (1<<16))
+    tb_size <<= 1;
+  tb_ring = new TraceRecord[tb_size];
+  for (size_t i = 0; i < tb_size; i++)
+    tb_ring[i].pos.store(i, std::memory_order_relaxed);
+  tb_servername = servername;
+  pthread_atfork (tb_drain, NULL, tb_atfork_child);
+  return true;
+}
+
+/** get a free slot, or NULL if the ring is full */
+static TraceRecord *
+tb_reserve (size_t &pos)
+{
+  if (!tb_running)
+    tb_start_thread();
+  pos = tb_head.load(std::memory_order_relaxed);
+  while (true)
+    {
+      TraceRecord *r = &tb_ring[pos & (tb_size-1)];
+      size_t rpos = r->pos.load(std::memory_order_acquire);
+      if (rpos == pos)
+        {
+          if (tb_head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+            return r;
+        }
+      else if (rpos < pos)
+        {
+          tb_dropped++;
+          return NULL;
+        }
+      else
+        pos = tb_head.load(std::memory_order_relaxed);
+    }
+}
+
+/** hand a filled slot to the writer */
+static void
+tb_publish (TraceRecord *r, size_t pos)
+{
+  r->pos.store(pos+1, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (tb_sleeping.load(std::memory_order_relaxed) && tb_sleeping.exchange(false))
+    tb_wake();
+}
+
+static void
+tb_copy (char *dst, size_t len, const std::string &a, const std::string &b = "")
+{
+  size_t i = a.copy(dst, len-1);
+  if (b.length() && i < len-2)
+    {
+      dst[i++] = '/';
+      i += b.copy(dst+i, len-1-i);
+    }
+  dst[i] = 0;
+}
+
+bool
+Trace::TraceBufferText (const int layer, const std::string &text)
+{
+  if (!tb_ring || tb_stopping)
+    return false;
+  size_t pos;
+  TraceRecord *r = tb_reserve(pos);
+  if (!r)
+    return true;
+  time_since(r->tv, started);
+  r->seq = seq;
+  r->layer = layer;
+  r->timestamps = timestamps;
+  r->packet = false;
+  tb_copy(r->name, sizeof(r->name), name, auxname);
+  r->len = text.copy((char *)r->data, sizeof(r->data));
+  r->truncated = r->len < text.length();
+  tb_publish(r, pos);
+  return true;
+}
+
+bool
+Trace::TraceBufferPacket (const int layer, const char *msg,
+                          const int Len, const uint8_t * data)
+{
+  if (!tb_ring || tb_stopping)
+    return false;
+  size_t pos;
+  TraceRecord *r = tb_reserve(pos);
+  if (!r)
+    return true;
+  time_since(r->tv, started);
+  r->seq = seq;
+  r->layer = layer;
+  r->timestamps = timestamps;
+  r->packet = true;
+  tb_copy(r->name, sizeof(r->name), name, auxname);
+  strncpy(r->msg, msg, sizeof(r->msg)-1);
+  r->msg[sizeof(r->msg)-1] = 0;
+  r->len = Len;
+  memcpy(r->data, data, Len < TRACEBUF_DATA ? Len : TRACEBUF_DATA);
+  tb_publish(r, pos);
+  return true;
+}
+
+void
+Trace::TraceHeader (const int layer)
+{
+  struct timeval tv;
+  time_since(tv, started);
 
   if (!trace_started)
     {
@@ -67,6 +394,8 @@ Trace::TracePacketUncond (const int layer, const char *msg, const int Len,
                           const uint8_t * data)
 {
   int i;
+  if (buffered && TraceBufferPacket(layer, msg, Len, data))
+    return;
   TraceHeader(layer);
   fmt::printf ("%s(%03d):", msg, Len);
   for (i = 0; i < Len; i++)
@@ -106,6 +435,8 @@ Trace::setup()
     trace_namelen = this->name.length();
   timestamps = cfg->value("timestamps",timestamps);
   layers = cfg->value("trace-mask",(int)layers);
+  int tbsize = cfg->value("trace-buffer", buffered ? (int)tb_size : 0);
+  buffered = tbsize > 0 && trace_buffer_init(tbsize, servername);
   int nlevel = error_level(cfg->value("error-level",""),level);
   if (nlevel == -1)
     {
@@ -98,7 +98,8 @@ public:
     level(orig.level),
     name(name.length() ? name : orig.name),
     started(orig.started),
-    timestamps(orig.timestamps)
+    timestamps(orig.timestamps),
+    buffered(orig.buffered)
   {
     seq = ++trace_seq;
     setup();
@@ -111,7 +112,8 @@ public:
     level(orig.level),
     name(s->name),
     started(orig.started),
-    timestamps(orig.timestamps)
+    timestamps(orig.timestamps),
+    buffered(orig.buffered)
   {
     seq = ++trace_seq;
     setup();
@@ -179,6 +181,8 @@ public:
   template <typename... Args>
   void TracePrintf (const int layer, const char *msg, const Args & ... args)
   {
+    if (buffered && TraceBufferText(layer, fmt::sprintf(msg, args ...)))
+      return;
     TraceHeader(layer);
     fmt::fprintf(stdout, msg, args ...);
     fmt::printf ("\n");
@@ -193,13 +197,16 @@ public:
   void ErrorPrintfUncond (const unsigned int msgid, const char *msg, const Args & ... args)
   {
     char c = get_level_char((msgid >> 28) & 0x0f);
+    // build the whole line first, so that it is written in one go
+    std::string line;
     if (servername.length())
-      fmt::fprintf(stderr, "%s: ",servername.c_str());
-    fmt::fprintf (stderr, "%c%08d: ", c, (msgid & 0xffffff));
-    fmt::fprintf (stderr, "[%2d:%s] ", seq, name.c_str());
+      line = fmt::sprintf("%s: ",servername);
+    line += fmt::sprintf ("%c%08d: ", c, (msgid & 0xffffff));
+    line += fmt::sprintf ("[%2d:%s] ", seq, name);
 
-    fmt::fprintf (stderr, msg, args...);
-    fprintf (stderr, "\n");
+    line += fmt::sprintf (msg, args...);
+    line += '\n';
+    fwrite (line.data(), 1, line.size(), stderr);
   }
 
 
@@ -232,9 +239,16 @@ private:
   struct timeval started;
   /** print timestamps when tracing */
   bool timestamps = true;
+  /** hand trace output to the trace buffer's writer thread */
+  bool buffered = false;
 
   /** print the common header */
   void TraceHeader (const int layer);
+  /** queue a message for the trace buffer's writer thread.
+   * Returns false if the buffer is not running. */
+  bool TraceBufferText (const int layer, const std::string &text);
+  bool TraceBufferPacket (const int layer, const char *msg,
+                          const int Len, const uint8_t * data);
 
   char get_level_char(const int level) const;
 
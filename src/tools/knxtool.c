@@ -82,7 +82,7 @@ mpeitype madcread mread mwrite mpropread mpropwrite mpropdesc mpropscan grouprea
 msetkey grouplisten groupresponse groupsresponse groupsocketlisten groupsocketread mpropscanpoll \n\
 vbusmonitor1poll groupreadresponse groupcacheenable groupcachedisable groupcacheclear groupcacheremove \n\
 groupcachereadsync groupcacheread mwriteplain mrestart groupsocketwrite groupsocketswrite \n\
-xpropread xpropwrite groupcachelastupdates busmonitor3 vbusmonitor3 eibread-cgi eibwrite-cgi \n\
+xpropread xpropwrite groupcachelastupdates groupcachelastvalues groupcachereadmulti busmonitor3 vbusmonitor3 eibread-cgi eibwrite-cgi \n\
 vbusmonitor1time mqttpub mqttsub\n");
       return 0;
     }
@@ -529,6 +529,127 @@ vbusmonitor1time mqttpub mqttsub\n");
         }
       printf ("\n");
     }
+  else if (strcmp (prog, "groupcachelastvalues") == 0)
+    {
+      static uint8_t vbuf[65536];
+      int i;
+      int start;
+      int timeout;
+      uint32_t end;
+
+      if (ac != 4)
+        die ("usage: %s url start-position timeout", prog);
+      con = open_con(ag[1]);
+      start = atoi (ag[2]);
+      timeout = atoi (ag[3]);
+
+      len = EIB_Cache_LastValues (con, start, timeout, sizeof (vbuf), vbuf, &end);
+      if (len == -1)
+        die ("Read failed");
+
+      printf ("new position: %d\n", end);
+      for (i = 0; i + 11 <= len; i += 11 + vbuf[i + 10])
+        {
+          uint8_t *r = vbuf + i;
+          int dlen = r[10];
+
+          if (i + 11 + dlen > len)
+            break;
+          printf ("%u ", ((uint32_t) r[0] << 24) | (r[1] << 16) | (r[2] << 8) | r[3]);
+          printGroup ((r[4] << 8) | r[5]);
+          printf (" from ");
+          printIndividual ((r[6] << 8) | r[7]);
+          printf (" age %d", (r[8] << 8) | r[9]);
+          if (dlen >= 2)
+            {
+              printf (": ");
+              if (dlen == 2)
+                printf ("%02X", r[12] & 0x3F);
+              else
+                printHex (dlen - 2, r + 13);
+            }
+          printf ("\n");
+        }
+      printf ("\n");
+    }
+  else if (strcmp (prog, "groupcachereadmulti") == 0)
+    {
+      static uint8_t vbuf[65536];
+      uint8_t *ranges;
+      uint16_t next;
+      int i;
+
+      if (ac < 5)
+        die ("usage: %s url age read-missing groupaddr[-groupaddr]...", prog);
+      con = open_con(ag[1]);
+      ranges = (uint8_t *) malloc ((ac - 4) * 4);
+      if (!ranges)
+        die ("out of memory");
+      for (i = 4; i < ac; i++)
+        {
+          char first[32];
+          const char *last = strchr (ag[i], '-');
+          eibaddr_t a, b;
+
+          if (last && last - ag[i] < (int) sizeof (first))
+            {
+              memcpy (first, ag[i], last - ag[i]);
+              first[last - ag[i]] = 0;
+              a = readgaddr (first);
+              b = readgaddr (last + 1);
+            }
+          else
+            a = b = readgaddr (ag[i]);
+          ranges[(i - 4) * 4 + 0] = (a >> 8) & 0xff;
+          ranges[(i - 4) * 4 + 1] = a & 0xff;
+          ranges[(i - 4) * 4 + 2] = (b >> 8) & 0xff;
+          ranges[(i - 4) * 4 + 3] = b & 0xff;
+        }
+
+    again:
+      len = EIB_Cache_ReadMulti (con, atoi (ag[2]), atoi (ag[3]) ? 1 : 0,
+                                 (ac - 4) * 4, ranges, sizeof (vbuf), vbuf, &next);
+      if (len == -1)
+        die ("Read failed");
+
+      for (i = 0; i + 7 <= len; i += 7 + vbuf[i + 6])
+        {
+          uint8_t *r = vbuf + i;
+          int dlen = r[6];
+
+          if (i + 7 + dlen > len)
+            break;
+          printGroup ((r[0] << 8) | r[1]);
+          printf (" from ");
+          printIndividual ((r[2] << 8) | r[3]);
+          printf (" age %d", (r[4] << 8) | r[5]);
+          if (dlen >= 2)
+            {
+              printf (": ");
+              if (dlen == 2)
+                printf ("%02X", r[8] & 0x3F);
+              else
+                printHex (dlen - 2, r + 9);
+            }
+          printf ("\n");
+        }
+      if (next)
+        {
+          printf ("continue at ");
+          printGroup (next);
+          printf ("\n");
+          /* ranges which start before next continue there; the server
+           * skips those which now end before they start */
+          for (i = 0; i < (ac - 4) * 4; i += 4)
+            if (((ranges[i] << 8) | ranges[i + 1]) < next)
+              {
+                ranges[i] = (next >> 8) & 0xff;
+                ranges[i + 1] = next & 0xff;
+              }
+          goto again;
+        }
+      free (ranges);
+    }
   else if (strcmp (prog, "groupcacheread") == 0)
     {
       if (ac != 3)
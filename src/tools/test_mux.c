@@ -0,0 +1,190 @@
+/*
+    test_mux - test client session multiplexing
+    Copyright (C) 2005-2011 Martin Koegler <mkoegler@auto.tuwien.ac.at>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Exercises client session multiplexing (EIB_MUX_*) on a knxd unix
+ * socket, for tools/test.sh. The client library doesn't speak it, so
+ * this talks the protocol directly. */
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "eibtypes.h"
+
+/* no session prefix */
+#define NONE -1
+
+static const char *path;
+
+static void
+die (const char *what)
+{
+  fprintf (stderr, "test_mux: %s failed\n", what);
+  exit (1);
+}
+
+static int
+connect_knxd (void)
+{
+  struct sockaddr_un addr;
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0)
+    die ("socket");
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    die ("connect");
+  return fd;
+}
+
+/** send a message of this type with len bytes of arguments */
+static void
+send_msg (int fd, int session, int type, int len, const uint8_t * args)
+{
+  uint8_t buf[64];
+  int pos = 2;
+
+  if (session != NONE)
+    {
+      buf[pos++] = session >> 8;
+      buf[pos++] = session & 0xff;
+    }
+  buf[pos++] = type >> 8;
+  buf[pos++] = type & 0xff;
+  memcpy (buf + pos, args, len);
+  pos += len;
+  buf[0] = (pos - 2) >> 8;
+  buf[1] = (pos - 2) & 0xff;
+  if (write (fd, buf, pos) != pos)
+    die ("write");
+}
+
+static void
+read_all (int fd, uint8_t * buf, int len)
+{
+  while (len > 0)
+    {
+      struct pollfd p = { fd, POLLIN, 0 };
+      int i;
+
+      if (poll (&p, 1, 5000) != 1)
+        die ("read (timeout)");
+      i = read (fd, buf, len);
+      if (i <= 0)
+        die ("read");
+      buf += i;
+      len -= i;
+    }
+}
+
+/** receive a message, which must be for this session and of this type.
+ * Returns the number of argument bytes, which are stored in args. */
+static int
+expect (int fd, int session, int type, uint8_t * args, const char *what)
+{
+  uint8_t buf[0x10000];
+  int len, pos = 0;
+
+  read_all (fd, buf, 2);
+  len = (buf[0] << 8) | buf[1];
+  read_all (fd, buf, len);
+  if (session != NONE)
+    {
+      if (len < 2 || ((buf[0] << 8) | buf[1]) != session)
+        die (what);
+      pos = 2;
+    }
+  if (len < pos + 2 || ((buf[pos] << 8) | buf[pos + 1]) != type)
+    die (what);
+  pos += 2;
+  if (args)
+    memcpy (args, buf + pos, len - pos);
+  return len - pos;
+}
+
+static void
+mux_call (int fd, int type, int id, int reply, const char *what)
+{
+  uint8_t a[2] = { id >> 8, id & 0xff };
+
+  send_msg (fd, 0, type, 2, a);
+  expect (fd, 0, reply, NULL, what);
+}
+
+int
+main (int ac, char *ag[])
+{
+  static const uint8_t group_rw[3] = { 0, 0, 0 };
+  static const uint8_t group_wo[3] = { 0, 0, 1 };
+  /* A_GroupValue_Write 1 to 1/2/5 */
+  static const uint8_t gwrite[4] = { 0x0a, 0x05, 0x00, 0x81 };
+  uint8_t res[16];
+  int fd, i;
+
+  if (ac != 2)
+    {
+      fprintf (stderr, "usage: %s knxd-socket\n", ag[0]);
+      exit (1);
+    }
+  path = ag[1];
+
+  fd = connect_knxd ();
+  send_msg (fd, NONE, EIB_MUX_ENABLE, 0, NULL);
+  expect (fd, NONE, EIB_MUX_ENABLE, NULL, "enable");
+
+  mux_call (fd, EIB_MUX_OPEN, 1, EIB_MUX_OPEN, "open 1");
+  mux_call (fd, EIB_MUX_OPEN, 2, EIB_MUX_OPEN, "open 2");
+  mux_call (fd, EIB_MUX_OPEN, 1, EIB_CONNECTION_INUSE, "duplicate id");
+  send_msg (fd, 7, EIB_OPEN_GROUPCON, 3, group_rw);
+  expect (fd, 7, EIB_INVALID_REQUEST, NULL, "unknown id");
+
+  /* a write in session 1 reaches the group socket in session 2 */
+  send_msg (fd, 1, EIB_OPEN_GROUPCON, 3, group_wo);
+  expect (fd, 1, EIB_OPEN_GROUPCON, NULL, "group socket 1");
+  send_msg (fd, 2, EIB_OPEN_GROUPCON, 3, group_rw);
+  expect (fd, 2, EIB_OPEN_GROUPCON, NULL, "group socket 2");
+  send_msg (fd, 1, EIB_GROUP_PACKET, 4, gwrite);
+  if (expect (fd, 2, EIB_GROUP_PACKET, res, "group write") != 6
+      || memcmp (res + 2, gwrite, 4))
+    die ("group write data");
+
+  mux_call (fd, EIB_MUX_CLOSE, 1, EIB_MUX_CLOSE, "close 1");
+  mux_call (fd, EIB_MUX_CLOSE, 1, EIB_INVALID_REQUEST, "close closed id");
+  send_msg (fd, 1, EIB_OPEN_GROUPCON, 3, group_rw);
+  expect (fd, 1, EIB_INVALID_REQUEST, NULL, "closed id");
+
+  /* disconnect with session 2 still open. knxd must release its client
+   * address, else we can't open as many sessions as before. */
+  close (fd);
+  usleep (200000);
+  fd = connect_knxd ();
+  send_msg (fd, NONE, EIB_MUX_ENABLE, 0, NULL);
+  expect (fd, NONE, EIB_MUX_ENABLE, NULL, "enable again");
+  for (i = 1; i <= 4; i++)
+    mux_call (fd, EIB_MUX_OPEN, i, EIB_MUX_OPEN, "reopen");
+  close (fd);
+  return 0;
+}
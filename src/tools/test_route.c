@@ -0,0 +1,179 @@
+/*
+    test_route - test unicast routing
+    Copyright (C) 2005-2011 Martin Koegler <mkoegler@auto.tuwien.ac.at>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Sends unicast telegrams between two knxd client connections, for
+ * tools/test.sh. */
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "eibtypes.h"
+
+static const char *path;
+
+static void
+die (const char *what)
+{
+  fprintf (stderr, "test_route: %s failed\n", what);
+  exit (1);
+}
+
+static int
+connect_knxd (void)
+{
+  struct sockaddr_un addr;
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0)
+    die ("socket");
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    die ("connect");
+  return fd;
+}
+
+/** send a message of this type with len bytes of arguments */
+static void
+send_msg (int fd, int type, int len, const uint8_t * args)
+{
+  uint8_t buf[64];
+  int pos = 2;
+
+  buf[pos++] = type >> 8;
+  buf[pos++] = type & 0xff;
+  memcpy (buf + pos, args, len);
+  pos += len;
+  buf[0] = (pos - 2) >> 8;
+  buf[1] = (pos - 2) & 0xff;
+  if (write (fd, buf, pos) != pos)
+    die ("write");
+}
+
+static void
+read_all (int fd, uint8_t * buf, int len)
+{
+  while (len > 0)
+    {
+      struct pollfd p = { fd, POLLIN, 0 };
+      int i;
+
+      if (poll (&p, 1, 5000) != 1)
+        die ("read (timeout)");
+      i = read (fd, buf, len);
+      if (i <= 0)
+        die ("read");
+      buf += i;
+      len -= i;
+    }
+}
+
+/** receive a message, which must be of this type.
+ * Returns the number of argument bytes, which are stored in args. */
+static int
+expect (int fd, int type, uint8_t * args, const char *what)
+{
+  uint8_t buf[0x10000];
+  int len, pos = 0;
+
+  read_all (fd, buf, 2);
+  len = (buf[0] << 8) | buf[1];
+  read_all (fd, buf, len);
+  if (len < pos + 2 || ((buf[pos] << 8) | buf[pos + 1]) != type)
+    die (what);
+  pos += 2;
+  if (args)
+    memcpy (args, buf + pos, len - pos);
+  return len - pos;
+}
+
+/** open a T_TPDU connection with the connection's own address */
+static int
+open_tpdu (void)
+{
+  static const uint8_t src[3] = { 0, 0, 0 };
+  int fd = connect_knxd ();
+
+  send_msg (fd, EIB_OPEN_T_TPDU, 3, src);
+  expect (fd, EIB_OPEN_T_TPDU, NULL, "open");
+  return fd;
+}
+
+/** send this TPDU to this address */
+static void
+send_tpdu (int fd, uint16_t dest, const uint8_t * tpdu)
+{
+  uint8_t a[4] = { dest >> 8, dest & 0xff, tpdu[0], tpdu[1] };
+
+  send_msg (fd, EIB_APDU_PACKET, 4, a);
+}
+
+static uint16_t
+parse_addr (const char *s)
+{
+  unsigned int a, b, c;
+
+  if (sscanf (s, "%u.%u.%u", &a, &b, &c) != 3)
+    die ("address");
+  return (a << 12) | (b << 8) | c;
+}
+
+int
+main (int ac, char *ag[])
+{
+  /* A_DeviceDescriptor_Read */
+  static const uint8_t tpdu[2] = { 0x03, 0x00 };
+  uint8_t res[16];
+  uint16_t a_addr, b_addr;
+  int a, b;
+
+  if (ac != 5)
+    {
+      fprintf (stderr, "usage: %s knxd-socket addr1 addr2 unknown-addr\n",
+               ag[0]);
+      exit (1);
+    }
+  path = ag[1];
+  a_addr = parse_addr (ag[2]);
+  b_addr = parse_addr (ag[3]);
+
+  /* knxd assigns client addresses in order */
+  a = open_tpdu ();
+  b = open_tpdu ();
+
+  /* B gets A's telegram. tools/test.sh checks that nothing else did. */
+  send_tpdu (a, b_addr, tpdu);
+  if (expect (b, EIB_APDU_PACKET, res, "receive") != 4
+      || ((res[0] << 8) | res[1]) != a_addr || memcmp (res + 2, tpdu, 2))
+    die ("receive data");
+
+  /* nobody has this one, so it goes everywhere */
+  send_tpdu (a, parse_addr (ag[4]), tpdu);
+  usleep (200000);
+  close (a);
+  close (b);
+  return 0;
+}
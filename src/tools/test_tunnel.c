@@ -0,0 +1,279 @@
+/*
+    test_tunnel - tunnel throughput against a slow client
+    Copyright (C) 2005-2011 Martin Koegler <mkoegler@auto.tuwien.ac.at>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Connects to knxd's tunnel server as a client which delays its
+ * ACKs, like one behind a slow WAN link, and measures how fast knxd
+ * delivers telegrams to it. The telegrams are written via the unix
+ * socket. For tools/test.sh. */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "eibtypes.h"
+
+static const char *path;
+
+static void
+die (const char *what)
+{
+  fprintf (stderr, "test_tunnel: %s failed\n", what);
+  exit (1);
+}
+
+static int
+connect_knxd (void)
+{
+  struct sockaddr_un addr;
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0)
+    die ("socket");
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    die ("connect");
+  return fd;
+}
+
+/** send a message of this type with len bytes of arguments */
+static void
+send_msg (int fd, int type, int len, const uint8_t * args)
+{
+  uint8_t buf[64];
+  int pos = 2;
+
+  buf[pos++] = type >> 8;
+  buf[pos++] = type & 0xff;
+  memcpy (buf + pos, args, len);
+  pos += len;
+  buf[0] = (pos - 2) >> 8;
+  buf[1] = (pos - 2) & 0xff;
+  if (write (fd, buf, pos) != pos)
+    die ("write");
+}
+
+static void
+read_all (int fd, uint8_t * buf, int len)
+{
+  while (len > 0)
+    {
+      struct pollfd p = { fd, POLLIN, 0 };
+      int i;
+
+      if (poll (&p, 1, 5000) != 1)
+        die ("read (timeout)");
+      i = read (fd, buf, len);
+      if (i <= 0)
+        die ("read");
+      buf += i;
+      len -= i;
+    }
+}
+
+/** receive a message, which must be of this type.
+ * Returns the number of argument bytes, which are stored in args. */
+static int
+expect (int fd, int type, uint8_t * args, const char *what)
+{
+  uint8_t buf[0x10000];
+  int len, pos = 0;
+
+  read_all (fd, buf, 2);
+  len = (buf[0] << 8) | buf[1];
+  read_all (fd, buf, len);
+  if (len < pos + 2 || ((buf[pos] << 8) | buf[pos + 1]) != type)
+    die (what);
+  pos += 2;
+  if (args)
+    memcpy (args, buf + pos, len - pos);
+  return len - pos;
+}
+
+static int udp;
+static struct sockaddr_in server;
+static uint8_t channel;
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/** send a KNXnet/IP packet of this service type to the server */
+static void
+send_ip (int service, int len, const uint8_t * body)
+{
+  uint8_t buf[64];
+
+  buf[0] = 0x06;
+  buf[1] = 0x10;
+  buf[2] = service >> 8;
+  buf[3] = service & 0xff;
+  buf[4] = (len + 6) >> 8;
+  buf[5] = (len + 6) & 0xff;
+  memcpy (buf + 6, body, len);
+  if (sendto (udp, buf, len + 6, 0, (struct sockaddr *) &server,
+              sizeof (server)) != len + 6)
+    die ("sendto");
+}
+
+/** receive a KNXnet/IP packet; returns its service type, or -1 on timeout */
+static int
+recv_ip (uint8_t * buf, int len, double timeout)
+{
+  struct pollfd p = { udp, POLLIN, 0 };
+  int i;
+
+  if (poll (&p, 1, timeout < 0 ? 0 : (int) (timeout * 1000)) != 1)
+    return -1;
+  i = recv (udp, buf, len, 0);
+  if (i < 10 || buf[0] != 0x06 || buf[1] != 0x10)
+    die ("recv");
+  return (buf[2] << 8) | buf[3];
+}
+
+static void
+send_ack (uint8_t seq)
+{
+  uint8_t a[4] = { 4, channel, seq, 0 };
+
+  send_ip (0x0421, 4, a);
+}
+
+int
+main (int ac, char *ag[])
+{
+  static const uint8_t groupcon[3] = { 0, 0, 1 };
+  /* A_GroupValue_Write 1 to 1/2/6 */
+  static const uint8_t gwrite[4] = { 0x0a, 0x06, 0x00, 0x81 };
+  /* ACKs we still have to send: when, and for which sequence number */
+  double due[256];
+  uint8_t dseq[256];
+  int dhead = 0, dtail = 0;
+  uint8_t buf[256], hpai[8];
+  struct sockaddr_in local;
+  socklen_t sl = sizeof (local);
+  int fd, i, count, received = 0, lost = 0;
+  uint8_t seq = 0;
+  double delay, start, last;
+
+  if (ac != 5)
+    {
+      fprintf (stderr, "usage: %s knxd-socket port count delay-ms\n", ag[0]);
+      exit (1);
+    }
+  path = ag[1];
+  count = atoi (ag[3]);
+  delay = atoi (ag[4]) / 1000.0;
+  if (count < 1 || count > 250)
+    die ("count");
+
+  udp = socket (AF_INET, SOCK_DGRAM, 0);
+  if (udp < 0)
+    die ("socket");
+  memset (&local, 0, sizeof (local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (udp, (struct sockaddr *) &local, sizeof (local)) < 0
+      || getsockname (udp, (struct sockaddr *) &local, &sl) < 0)
+    die ("bind");
+  server = local;
+  server.sin_port = htons (atoi (ag[2]));
+
+  /* CONNECT_REQUEST for a tunnel: control and data endpoint, CRI */
+  hpai[0] = 8;
+  hpai[1] = 1;
+  memcpy (hpai + 2, &local.sin_addr, 4);
+  memcpy (hpai + 6, &local.sin_port, 2);
+  memcpy (buf, hpai, 8);
+  memcpy (buf + 8, hpai, 8);
+  buf[16] = 4;
+  buf[17] = 4;
+  buf[18] = 2;
+  buf[19] = 0;
+  send_ip (0x0205, 20, buf);
+  if (recv_ip (buf, sizeof (buf), 5) != 0x0206 || buf[7] != 0)
+    die ("connect");
+  channel = buf[6];
+
+  fd = connect_knxd ();
+  send_msg (fd, EIB_OPEN_GROUPCON, 3, groupcon);
+  expect (fd, EIB_OPEN_GROUPCON, NULL, "open");
+  for (i = 0; i < count; i++)
+    send_msg (fd, EIB_GROUP_PACKET, 4, gwrite);
+
+  start = last = now ();
+  while (received < count || dhead != dtail)
+    {
+      double t = now ();
+      int type;
+
+      if (dhead != dtail && due[dtail] <= t)
+        {
+          send_ack (dseq[dtail]);
+          dtail = (dtail + 1) % 256;
+          continue;
+        }
+      if (t - last > 5)
+        die ("receive (timeout)");
+      type = recv_ip (buf, sizeof (buf), dhead != dtail ? due[dtail] - t : 1);
+      if (type != 0x0420 || buf[7] != channel)
+        continue;
+      last = now ();
+      if (buf[8] == seq)
+        {
+          /* L_Data.ind */
+          if (buf[10] != 0x29)
+            die ("tunnel data");
+          seq++;
+          received++;
+          /* lose one ACK: knxd has to repeat the frame, and mustn't
+           * give up on us */
+          if (received == count / 2 && !lost++)
+            continue;
+        }
+      else if ((uint8_t) (seq - buf[8]) > 32)
+        continue;               /* from the future: ignore, it'll be resent */
+      due[dhead] = last + delay;
+      dseq[dhead] = buf[8];
+      dhead = (dhead + 1) % 256;
+    }
+
+  printf ("%d telegrams in %.2f s, %.1f/s\n", count, last - start,
+          count / (last - start));
+  memcpy (buf + 2, hpai, 8);
+  buf[0] = channel;
+  buf[1] = 0;
+  send_ip (0x0209, 10, buf);
+  close (fd);
+  return 0;
+}
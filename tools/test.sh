@@ -143,8 +143,76 @@ diff -u "$(dirname "$0")"/logs/cache $L4 || E=4$E
 diff -u "$(dirname "$0")"/logs/listen $L5 || E=5$E
 test -z "$E"
 
+# bulk group cache reads. The values are long enough that a reply
+# can't hold all of them and must be continued.
+S4=$(tempfile); rm $S4
+L6=$(tempfile)
+knxd -n K4 -e 4.4.0 -E 4.4.1:5 -c -u$S4 -b dummy: &
+KNX4=$!
+trap 'echo T4; rm -f $L6 $EF; kill $KNX4; wait' 0 1 2
+sleep 1
+if ! knxtool groupswrite local:$S4 1/2/4 9 >/dev/null ; then echo X8; exit 1; fi
+set +x
+V=$(seq 253 | sed -e 's/.*/AA/')
+for i in $(seq 0 255) ; do
+  if ! knxtool groupwrite local:$S4 3/0/$i $V >/dev/null ; then echo X8; exit 1; fi
+done
+set -x
+# overlapping ranges in no particular order; each address once, sorted
+if ! knxtool groupcachereadmulti local:$S4 0 0 3/0/128-3/0/255 1/2/0-1/2/7 3/0/0-3/0/200 >>$L6 ; then echo X9; exit 1; fi
+if ! knxtool groupcachereadmulti local:$S4 0 0 1/2/4 1/2/5-1/2/9 3/0/254-3/0/255 >>$L6 ; then echo X9; exit 1; fi
+# the value stream needs several replies; each one continues where the last stopped
+P=0
+while : ; do
+  if ! knxtool groupcachelastvalues local:$S4 $P 0 >$EF ; then echo X10; exit 1; fi
+  cat $EF >>$L6
+  N=$(sed -n -e 's/^new position: //p' <$EF)
+  test $N != $P || break
+  P=$N
+done
+# client sessions multiplexed over one socket
+if ! test_mux $S4 ; then echo X11; exit 1; fi
+kill $KNX4
+wait $KNX4 || true
+trap 'echo T5; rm -f $L6 $EF' 0 1 2
+
+sed -e 's/ age [0-9]*//' -e 's/\(: AA AA\) .*/\1 .../' <$L6 | diff -u "$(dirname "$0")"/logs/cachebulk - || E=6$E
+test -z "$E"
+
+# unicast telegrams only go to the link which has the destination;
+# telegrams to unknown addresses go everywhere
+S5=$(tempfile); rm $S5
+L7=$(tempfile)
+knxd -n K5 -t 0xfffc -f 9 -e 4.5.0 -E 4.5.1:5 -u$S5 -B log -b dummy: >$L7 2>&1 &
+KNX5=$!
+trap 'echo T6; rm -f $L7 $EF; kill $KNX5; wait' 0 1 2
+sleep 1
+if ! test_route $S5 4.5.1 4.5.2 4.6.7 ; then echo X12; exit 1; fi
+kill $KNX5
+wait $KNX5 || true
+trap 'echo T7; rm -f $L7 $EF' 0 1 2
+grep -q "Send .*4\.5\.1 to 4\.6\.7" $L7 || E=7$E
+! grep -q "Send .*to 4\.5\.2" $L7 || E=8$E
+grep -q "down: 1 unicast frames sent to the destination's link, 1 flooded" $L7 || E=9$E
+test -z "$E"
+
+# tunnel throughput to a client which ACKs after 20 msec and loses
+# one ACK, without and with a send window
+S6=$(tempfile); rm $S6
+PORT3=$((9997 + $$))
+for W in 1 8 ; do
+  knxd -n K6 -e 4.6.0 -E 4.6.1:5 -u$S6 -A window=$W -T --Server=224.99.98.95:$PORT3 -b dummy: &
+  KNX6=$!
+  trap 'echo T8; rm -f $EF; kill $KNX6; wait' 0 1 2
+  sleep 1
+  if ! test_tunnel $S6 $PORT3 100 20 ; then echo X13; exit 1; fi
+  kill $KNX6
+  wait $KNX6 || true
+done
+trap 'echo T9; rm -f $EF' 0 1 2
+
 set +ex
 
-rm -f $L1 $L2 $L3 $L4 $L5 $E1 $E2 $E3 $E4 $E5 $EF
+rm -f $L1 $L2 $L3 $L4 $L5 $L6 $L7 $E1 $E2 $E3 $E4 $E5 $EF
 trap '' 0 1 2 
 echo DONE OK